@@ -6,28 +6,143 @@
 #include <functional>
 #include <stdexcept>
 #include <string>
-#include <iostream>
-#include "tuple_print.h"
+#include <map>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <chrono>
+#include "em_trace.h"
+
+//flat vector view of one parameter, so EM can measure and extrapolate steps.
+//specialize for parameter types other than these.
+template<typename P>
+struct Paramview;
+
+template<>
+struct Paramview<double>{
+	static void flatten(const double &p, std::vector<double> &v){
+		v.push_back(p);
+	}
+	static size_t unflatten(double &p, const std::vector<double> &v, size_t i){ //returns the next index
+		p = v[i];
+		return i + 1;
+	}
+};
+
+//values in key order; unflatten keeps the existing keys
+template<typename K>
+struct Paramview<std::map<K,double>>{
+	static void flatten(const std::map<K,double> &p, std::vector<double> &v){
+		for (const auto &kv : p){
+			v.push_back(kv.second);
+		}
+	}
+	static size_t unflatten(std::map<K,double> &p, const std::vector<double> &v, size_t i){
+		for (auto &kv : p){
+			kv.second = v[i++];
+		}
+		return i;
+	}
+};
+
+template<>
+struct Paramview<std::vector<double>>{
+	static void flatten(const std::vector<double> &p, std::vector<double> &v){
+		v.insert(v.end(), p.begin(), p.end());
+	}
+	static size_t unflatten(std::vector<double> &p, const std::vector<double> &v, size_t i){
+		for (double &x : p){
+			x = v[i++];
+		}
+		return i;
+	}
+};
+
+//applies Paramview to every member of a tuple, like TuplePrinter
+template<size_t N>
+struct TupleParamview{
+	template<typename...T>
+	static typename std::enable_if<(N<sizeof...(T))>::type
+	flatten(const std::tuple<T...> &t, std::vector<double> &v){
+		Paramview<typename std::tuple_element<N,std::tuple<T...>>::type>::flatten(std::get<N>(t), v);
+		TupleParamview<N+1>::flatten(t, v);
+	}
+
+	template<typename...T>
+	static typename std::enable_if<!(N<sizeof...(T))>::type
+	flatten(const std::tuple<T...> &t, std::vector<double> &v){
+	}
+
+	template<typename...T>
+	static typename std::enable_if<(N<sizeof...(T))>::type
+	unflatten(std::tuple<T...> &t, const std::vector<double> &v, size_t i){
+		i = Paramview<typename std::tuple_element<N,std::tuple<T...>>::type>::unflatten(std::get<N>(t), v, i);
+		TupleParamview<N+1>::unflatten(t, v, i);
+	}
+
+	template<typename...T>
+	static typename std::enable_if<!(N<sizeof...(T))>::type
+	unflatten(std::tuple<T...> &t, const std::vector<double> &v, size_t i){
+	}
+};
 
 //see https://www2.ee.washington.edu/techsite/papers/documents/UWEETR-2010-0002.pdf for a tutorial on EM
+//start(stop) runs until the relative change in likelihood or in every parameter is at most stop, or until max_iterations M steps.
+//with acceleration on (it is off by default), steps are extrapolated with SQUAREM (Varadhan and Roland 2008, scheme S3);
+//a step that isn't finite, leaves the parameter space (m_function throws std::runtime_error) or has a lower
+//likelihood than plain EM is replaced by the plain EM step.
+//nothing is timed or recorded unless tracing is on or there is an observer.
 template<typename... T>
 class EM{
 protected:
 	double likelihood;
+	std::function<void(std::tuple<T...> theta)> e_function; //optional. computes what q_function and m_function share at theta; called before either.
 	std::function<double(std::tuple<T...> theta)> q_function; //returns expected value of log likelihood function
 	std::function<std::tuple<T...>(std::tuple<T...> theta)> m_function; //returns theta that maximizes Q	
 	std::tuple<T...> theta;
+	int max_iterations;
+	bool accelerate;
+	int iterations; //M steps taken by the last start()
+	bool tracing;
+	em_observer_f observer;
+	EM_Trace trace;
+	EM_Record current; //iteration in progress
+	int records; //iterations recorded by this start()
+	bool recording();
+	void timed_e(const std::tuple<T...> &t);
+	double timed_q(const std::tuple<T...> &t);
+	std::tuple<T...> timed_m(const std::tuple<T...> &t);
+	void finish_record(const std::tuple<T...> &previous, const std::tuple<T...> &next, double next_likelihood, std::chrono::steady_clock::time_point begin);
 	double likelihood_diff(double, double);
+	std::tuple<T...> squarem_step(std::tuple<T...> theta0, double &next_likelihood); //sets next_likelihood to q of the returned theta
+	bool converged(const std::tuple<T...> &previous, const std::tuple<T...> &current, double previous_likelihood, double current_likelihood, double stop);
 public:
 	EM(std::function<double(std::tuple<T...>)> q_function, std::function<std::tuple<T...>(std::tuple<T...>)> m_function, std::tuple<T...> theta); //initialize with guess for theta
+	EM(std::function<void(std::tuple<T...>)> e_function, std::function<double(std::tuple<T...>)> q_function, std::function<std::tuple<T...>(std::tuple<T...>)> m_function, std::tuple<T...> theta);
 	std::tuple<T...> start(double stop); //start the EM. return theta.
 	double get_likelihood();
+	void set_theta(std::tuple<T...> theta); //guess to start the next start() from
+	int get_iterations();
+	void set_max_iterations(int n);
+	void set_acceleration(bool on); //SQUAREM; off by default
+	void set_tracing(bool on); //keep an EM_Record per iteration; off by default
+	void set_observer(em_observer_f f); //called after every iteration
+	const EM_Trace &get_trace(); //records from the last start()
+	void note_nr_iterations(int n); //for m_function to report its root finder's work
+	static std::vector<double> flatten(const std::tuple<T...> &t);
+	static std::tuple<T...> unflatten(std::tuple<T...> t, const std::vector<double> &v); //t gives the shape
+	static bool is_finite(const std::vector<double> &v);
+	static constexpr int default_max_iterations = 1000;
 };
 
 //definition of template class must be in h file
 
 template<typename...T>
-EM<T...>::EM(std::function<double(std::tuple<T...>)> q_function, std::function<std::tuple<T...>(std::tuple<T...>)> m_function, std::tuple<T...> theta) : likelihood(0), q_function(q_function), m_function(m_function), theta(theta){
+EM<T...>::EM(std::function<double(std::tuple<T...>)> q_function, std::function<std::tuple<T...>(std::tuple<T...>)> m_function, std::tuple<T...> theta) : EM(nullptr, q_function, m_function, theta){
+}
+
+template<typename...T>
+EM<T...>::EM(std::function<void(std::tuple<T...>)> e_function, std::function<double(std::tuple<T...>)> q_function, std::function<std::tuple<T...>(std::tuple<T...>)> m_function, std::tuple<T...> theta) : likelihood(0), e_function(e_function), q_function(q_function), m_function(m_function), theta(theta), max_iterations(default_max_iterations), accelerate(false), iterations(0), tracing(false), observer(), trace(), current(), records(0){
 }
 
 template<typename...T>
@@ -35,36 +150,253 @@ double EM<T...>::likelihood_diff(double previous, double current){
 	if (previous == 0){
 		return (current > 0 ? current : -current);
 	}
-	else if (current < previous){
-		// throw std::logic_error("likelihood went down. previous value: " + std::to_string(previous) + ", current value: " + std::to_string(current));
-		std::clog << "likelihood decreased by " << -(current - previous) << std::endl;
-		return current - previous;
-	} else {
-		return current - previous;
+	else {
+		return current - previous; //negative if the likelihood went down
 	}
 }
 
 template<typename...T>
 std::tuple<T...> EM<T...>::start(double stop){
-	int counter = 0;
-	double difference;
-	do{
-		double current_likelihood = q_function(theta);
-		std::clog << "Theta = " << theta << "\nlikelihood = " << current_likelihood << std::endl;
-		difference = likelihood_diff(likelihood, current_likelihood);
-		likelihood = current_likelihood;
-		theta = m_function(theta);
-	// } while (difference > stop);
-		counter++;
-	} while (counter < 20);
+	iterations = 0;
+	trace.clear();
+	current = EM_Record();
+	records = 0;
+	std::chrono::steady_clock::time_point begin;
+	if (recording()){
+		begin = std::chrono::steady_clock::now(); //the first record's wall time covers the initial q, as its estep time does
+	}
+	likelihood = timed_q(theta);
+	while (iterations < max_iterations){
+		if (recording() && iterations > 0){
+			begin = std::chrono::steady_clock::now();
+		}
+		int steps = iterations;
+		std::tuple<T...> next;
+		double next_likelihood;
+		if (accelerate){
+			next = squarem_step(theta, next_likelihood);
+		}
+		else{
+			next = timed_m(theta);
+			++iterations;
+			next_likelihood = timed_q(next);
+		}
+		if (recording()){
+			current.m_steps = iterations - steps;
+			finish_record(theta, next, next_likelihood, begin);
+		}
+		bool done = converged(theta, next, likelihood, next_likelihood, stop);
+		theta = next;
+		likelihood = next_likelihood;
+		if (done){
+			break;
+		}
+	}
 	return theta;
 }
 
+template<typename...T>
+bool EM<T...>::converged(const std::tuple<T...> &previous, const std::tuple<T...> &current, double previous_likelihood, double current_likelihood, double stop){
+	double difference = likelihood_diff(previous_likelihood, current_likelihood);
+	if (std::abs(difference) <= stop * std::abs(previous_likelihood)){
+		return true;
+	}
+	std::vector<double> a = flatten(previous);
+	std::vector<double> b = flatten(current);
+	for (size_t i = 0; i < a.size(); ++i){
+		if (std::abs(b[i] - a[i]) > stop * std::max(std::abs(a[i]), std::numeric_limits<double>::min())){
+			return false;
+		}
+	}
+	return true;
+}
+
+//two EM steps give r = theta1 - theta0 and v = theta2 - 2 theta1 + theta0.
+//we jump to theta0 - 2 alpha r + alpha^2 v and take one more EM step from there to stabilize it.
+template<typename...T>
+std::tuple<T...> EM<T...>::squarem_step(std::tuple<T...> theta0, double &next_likelihood){
+	std::tuple<T...> theta1 = timed_m(theta0);
+	std::tuple<T...> theta2 = timed_m(theta1);
+	iterations += 2;
+	double em_likelihood = timed_q(theta2);
+	next_likelihood = em_likelihood;
+
+	std::vector<double> x0 = flatten(theta0);
+	std::vector<double> x1 = flatten(theta1);
+	std::vector<double> x2 = flatten(theta2);
+	double rr = 0.0;
+	double vv = 0.0;
+	std::vector<double> r(x0.size());
+	std::vector<double> v(x0.size());
+	for (size_t i = 0; i < x0.size(); ++i){
+		r[i] = x1[i] - x0[i];
+		v[i] = x2[i] - x1[i] - r[i];
+		rr += r[i] * r[i];
+		vv += v[i] * v[i];
+	}
+	if (vv == 0.0 || iterations >= max_iterations){
+		return theta2;
+	}
+	double alpha = std::min(-std::sqrt(rr / vv), -1.0); //alpha = -1 is just theta2
+	for (size_t i = 0; i < x0.size(); ++i){
+		x0[i] = x0[i] - 2 * alpha * r[i] + alpha * alpha * v[i];
+	}
+	if (!is_finite(x0)){
+		return theta2;
+	}
+	//the jump can leave the parameter space (an epsilon past 1/3, a negative pi);
+	//models throw there, and the plain EM step is used instead
+	std::tuple<T...> accelerated;
+	double accelerated_likelihood;
+	++iterations;
+	try{
+		accelerated = timed_m(unflatten(theta0, x0));
+		accelerated_likelihood = timed_q(accelerated);
+	}
+	catch (const std::runtime_error &e){
+		return theta2;
+	}
+	if (!std::isfinite(accelerated_likelihood) || !is_finite(flatten(accelerated)) || accelerated_likelihood < em_likelihood){
+		return theta2;
+	}
+	current.accelerated = true;
+	next_likelihood = accelerated_likelihood;
+	return accelerated;
+}
+
+template<typename...T>
+bool EM<T...>::recording(){
+	return tracing || observer;
+}
+
+//e_function time counts as E step time whether q_function or m_function needed it
+template<typename...T>
+void EM<T...>::timed_e(const std::tuple<T...> &t){
+	if (!e_function){
+		return;
+	}
+	if (!recording()){
+		e_function(t);
+		return;
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	e_function(t);
+	current.estep_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+template<typename...T>
+double EM<T...>::timed_q(const std::tuple<T...> &t){
+	timed_e(t);
+	if (!recording()){
+		return q_function(t);
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	double q = q_function(t);
+	current.estep_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return q;
+}
+
+template<typename...T>
+std::tuple<T...> EM<T...>::timed_m(const std::tuple<T...> &t){
+	timed_e(t);
+	if (!recording()){
+		return m_function(t);
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	std::tuple<T...> m = m_function(t);
+	current.mstep_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return m;
+}
+
+//the first record also carries the time to evaluate the starting theta
+template<typename...T>
+void EM<T...>::finish_record(const std::tuple<T...> &previous, const std::tuple<T...> &next, double next_likelihood, std::chrono::steady_clock::time_point begin){
+	current.iteration = ++records;
+	current.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	current.likelihood = next_likelihood;
+	current.theta = flatten(next);
+	std::vector<double> a = flatten(previous);
+	current.max_delta = 0.0;
+	for (size_t i = 0; i < a.size(); ++i){
+		current.max_delta = std::max(current.max_delta, std::abs(current.theta[i] - a[i]));
+	}
+	if (observer){
+		observer(current);
+	}
+	if (tracing){
+		trace.records.push_back(current);
+	}
+	current = EM_Record();
+}
+
+template<typename...T>
+std::vector<double> EM<T...>::flatten(const std::tuple<T...> &t){
+	std::vector<double> v;
+	TupleParamview<0>::flatten(t, v);
+	return v;
+}
+
+template<typename...T>
+std::tuple<T...> EM<T...>::unflatten(std::tuple<T...> t, const std::vector<double> &v){
+	TupleParamview<0>::unflatten(t, v, 0);
+	return t;
+}
+
+template<typename...T>
+bool EM<T...>::is_finite(const std::vector<double> &v){
+	for (double x : v){
+		if (!std::isfinite(x)){
+			return false;
+		}
+	}
+	return true;
+}
+
 template<typename...T>
 double EM<T...>::get_likelihood(){
 	return likelihood;
 }
 
+template<typename...T>
+void EM<T...>::set_theta(std::tuple<T...> theta){
+	this->theta = theta;
+}
+
+template<typename...T>
+int EM<T...>::get_iterations(){
+	return iterations;
+}
+
+template<typename...T>
+void EM<T...>::set_max_iterations(int n){
+	max_iterations = n;
+}
+
+template<typename...T>
+void EM<T...>::set_acceleration(bool on){
+	accelerate = on;
+}
+
+template<typename...T>
+void EM<T...>::set_tracing(bool on){
+	tracing = on;
+}
+
+template<typename...T>
+void EM<T...>::set_observer(em_observer_f f){
+	observer = f;
+}
+
+template<typename...T>
+const EM_Trace &EM<T...>::get_trace(){
+	return trace;
+}
+
+template<typename...T>
+void EM<T...>::note_nr_iterations(int n){
+	current.nr_iterations += n;
+}
+
 
 
 #endif
\ No newline at end of file
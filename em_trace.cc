@@ -0,0 +1,58 @@
+#include "em_trace.h"
+#include <fstream>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+
+EM_Record::EM_Record() : iteration(0), m_steps(0), accelerated(false), wall_seconds(0), estep_seconds(0), mstep_seconds(0), likelihood(0), max_delta(0), nr_iterations(0), theta() {
+}
+
+void EM_Trace::clear(){
+	records.clear();
+}
+
+//JSON has no inf or nan
+static void write_number(std::ostream &os, double x){
+	if (std::isfinite(x)){
+		os << x;
+	}
+	else{
+		os << "null";
+	}
+}
+
+void EM_Trace::write_json(std::ostream &os, const EM_Record &r){
+	std::streamsize precision = os.precision(std::numeric_limits<double>::max_digits10);
+	os << "{\"iteration\":" << r.iteration << ",\"m_steps\":" << r.m_steps << ",\"accelerated\":" << (r.accelerated ? "true" : "false");
+	os << ",\"wall_seconds\":"; write_number(os, r.wall_seconds);
+	os << ",\"estep_seconds\":"; write_number(os, r.estep_seconds);
+	os << ",\"mstep_seconds\":"; write_number(os, r.mstep_seconds);
+	os << ",\"likelihood\":"; write_number(os, r.likelihood);
+	os << ",\"max_delta\":"; write_number(os, r.max_delta);
+	os << ",\"nr_iterations\":" << r.nr_iterations << ",\"theta\":[";
+	for (size_t i = 0; i < r.theta.size(); ++i){
+		if (i != 0){
+			os << ",";
+		}
+		write_number(os, r.theta[i]);
+	}
+	os << "]}";
+	os.precision(precision);
+}
+
+//'\n' instead of std::endl so the stream is only flushed once
+void EM_Trace::write_jsonl(std::ostream &os) const{
+	for (const EM_Record &r : records){
+		write_json(os, r);
+		os << '\n';
+	}
+	os.flush();
+}
+
+void EM_Trace::write_jsonl(std::string filename) const{
+	std::ofstream out(filename);
+	if (!out){
+		throw std::runtime_error("error opening " + filename + " for writing");
+	}
+	write_jsonl(out);
+}
@@ -0,0 +1,38 @@
+#ifndef __MEEP_EM_TRACE_INCLUDED__
+#define __MEEP_EM_TRACE_INCLUDED__
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <functional>
+
+//what one EM iteration did. with SQUAREM an iteration is several M steps.
+//the first iteration also includes the q evaluation at the starting theta.
+//E step time is time spent in e_function and q_function, M step time is time spent in m_function.
+struct EM_Record{
+	int iteration;
+	int m_steps;
+	bool accelerated; //the SQUAREM jump was kept
+	double wall_seconds;
+	double estep_seconds;
+	double mstep_seconds;
+	double likelihood; //q_function of theta after the iteration
+	double max_delta; //largest absolute change in any parameter
+	int nr_iterations; //reported by m_function through EM::note_nr_iterations
+	std::vector<double> theta; //flattened
+	EM_Record();
+};
+
+typedef std::function<void(const EM_Record&)> em_observer_f;
+
+//in-memory trace of an EM run
+class EM_Trace{
+public:
+	std::vector<EM_Record> records;
+	void clear();
+	void write_jsonl(std::ostream &os) const; //one JSON object per record
+	void write_jsonl(std::string filename) const; //throws
+	static void write_json(std::ostream &os, const EM_Record &r);
+};
+
+#endif
@@ -0,0 +1,13 @@
+#include "errmodel.h"
+
+namespace meep_errmodel{
+	double calc_epsilon(const std::vector<double> &s){
+		switch(s.size() - 1){
+			case 1: return solve_epsilon(Fixed_ploidy<1>(), s.data());
+			case 2: return solve_epsilon(Fixed_ploidy<2>(), s.data());
+			case 4: return solve_epsilon(Fixed_ploidy<4>(), s.data());
+			case 6: return solve_epsilon(Fixed_ploidy<6>(), s.data());
+			default: return solve_epsilon(Runtime_ploidy{(int)s.size() - 1}, s.data());
+		}
+	}
+}
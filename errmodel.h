@@ -0,0 +1,87 @@
+#ifndef __MEEP_ERRMODEL_INCLUDED__
+#define __MEEP_ERRMODEL_INCLUDED__
+
+#include <vector>
+#include <cmath>
+#include <cstddef>
+
+//sequencing error model for any ploidy P. a base that matches k of a genotype's P alleles is read with probability
+//	k/P (1 - 3 epsilon) + (P - k)/P epsilon
+//and s[i] counts bases that match P - i alleles, so s has P + 1 entries.
+//the algorithms are written once against a ploidy type: Fixed_ploidy<P> makes P a compile time constant so loops
+//over s unroll, Runtime_ploidy handles everything else. calc_epsilon picks Fixed_ploidy for ploidy 1, 2, 4 and 6.
+namespace meep_errmodel{
+	template<int P>
+	struct Fixed_ploidy{
+		constexpr int get() const {return P;}
+	};
+
+	struct Runtime_ploidy{
+		int p;
+		int get() const {return p;}
+	};
+
+	inline double p_base(int matches, int ploidy, double epsilon){
+		return (matches + (ploidy - 4.0 * matches) * epsilon) / ploidy;
+	}
+
+	//epsilon maximizing sum s[i] log p_base(P - i). that's concave on [0, 1/3], so we find the root of its derivative
+	//with Newton's method, falling back to bisection whenever a step leaves the bracket.
+	template<typename Ploidy>
+	double solve_epsilon(Ploidy ploidy, const double *s){
+		const int P = ploidy.get();
+		double total = 0.0;
+		for (int i = 0; i <= P; ++i){
+			total += s[i];
+		}
+		if (total <= 0){
+			return 0.0;
+		}
+		//d/de log(k + (P - 4k) e) = (P - 4k) / (k + (P - 4k) e)
+		auto derivatives = [&](double e, double &d, double &dd){
+			d = 0.0;
+			dd = 0.0;
+			for (int i = 0; i <= P; ++i){
+				int k = P - i;
+				double slope = P - 4.0 * k;
+				double r = slope / (k + slope * e);
+				d += (s[i] == 0 ? 0.0 : s[i] * r);
+				dd -= (s[i] == 0 ? 0.0 : s[i] * r * r);
+			}
+		};
+		double lo = 0.0;
+		double hi = 1.0 / 3;
+		double d, dd;
+		derivatives(lo, d, dd); //+inf if any base matches no alleles
+		if (d <= 0){
+			return lo;
+		}
+		derivatives(hi, d, dd); //-inf if any base matches every allele
+		if (d >= 0){
+			return hi;
+		}
+		double e = (lo + hi) / 2;
+		for (int iter = 0; iter < 100; ++iter){
+			derivatives(e, d, dd);
+			if (d > 0){
+				lo = e;
+			}
+			else{
+				hi = e;
+			}
+			double next = e - d / dd;
+			if (!(next > lo && next < hi)){
+				next = (lo + hi) / 2;
+			}
+			if (std::abs(next - e) <= 1e-15 * e || hi - lo <= 1e-15){
+				return next;
+			}
+			e = next;
+		}
+		return e;
+	}
+
+	double calc_epsilon(const std::vector<double> &s); //ploidy is s.size() - 1
+}
+
+#endif
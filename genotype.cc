@@ -1,34 +1,104 @@
 #include "genotype.h"
 #include "popstatem.h"
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
 
 const std::vector<char> Genotype::alleles = {'A','T','G','C'};
 
+namespace{
+	std::array<std::atomic<const Genotype::index_table_t*>,Genotype::max_table_ploidy + 1> index_tables; //static, so they start out null
+	std::mutex index_tables_mutex;
+}
+
 
-Genotype::Genotype(std::string gtstr) : ploidy(0), gt() {
+Genotype::Genotype(std::string gtstr) : counts(), ploidy(0) {
 	for(auto it = gtstr.begin(); it != gtstr.end(); ++it){
-		++gt[*it];
+		int i = allele_index(*it);
+		if (i < 0){
+			throw std::invalid_argument("invalid allele in genotype " + gtstr);
+		}
+		++counts[i];
 		ploidy+=1;
 	}
 }
 
-Genotype::Genotype(std::map<char,int> gt) : ploidy(0), gt(gt) {
+Genotype::Genotype(std::map<char,int> gt) : counts(), ploidy(0) {
 	for(auto it = gt.begin(); it!= gt.end(); ++it){
+		if (it->second == 0){
+			continue;
+		}
+		int i = allele_index(it->first);
+		if (i < 0){
+			throw std::invalid_argument("invalid allele in genotype");
+		}
+		counts[i] = it->second;
 		ploidy += it->second;
 	}
 }
 
-int Genotype::numbase(char n){
-	return gt[n];
+Genotype::Genotype(const counts_t &counts) : counts(counts), ploidy(0) {
+	for (uint8_t c : counts){
+		ploidy += c;
+	}
+}
+
+Genotype::Genotype() : counts(), ploidy(0) {
+}
+
+int Genotype::numbase(char n) const{
+	int i = allele_index(n);
+	return (i < 0 ? 0 : counts[i]);
 }
 
-int Genotype::numnotbase(char n){
-	return ploidy - gt[n];
+int Genotype::numnotbase(char n) const{
+	return ploidy - numbase(n);
 }
 
-int Genotype::getploidy(){
+int Genotype::getploidy() const{
 	return ploidy;
 }
 
+int Genotype::code() const{
+	int c = 0;
+	for (size_t i = numalleles; i-- > 0;){
+		c = c * (ploidy + 1) + counts[i];
+	}
+	return c;
+}
+
+int Genotype::index() const{
+	return index(*index_table(ploidy));
+}
+
+//a published table is never changed or freed, so once built it is read without the lock
+const Genotype::index_table_t *Genotype::index_table(int ploidy){
+	if (ploidy < 0 || ploidy > max_table_ploidy){
+		throw std::out_of_range("no genotype index table for ploidy " + std::to_string(ploidy));
+	}
+	const index_table_t *table = index_tables[ploidy].load(std::memory_order_acquire);
+	if (table != nullptr){
+		return table;
+	}
+	std::lock_guard<std::mutex> lock(index_tables_mutex);
+	table = index_tables[ploidy].load(std::memory_order_relaxed);
+	if (table == nullptr){
+		int ncodes = 1;
+		for (size_t i = 0; i < numalleles; ++i){
+			ncodes *= ploidy + 1;
+		}
+		index_table_t *built = new index_table_t(ncodes, -1);
+		std::vector<Genotype> gts = enumerate_gts(ploidy);
+		for (size_t i = 0; i < gts.size(); ++i){
+			(*built)[gts[i].code()] = i;
+		}
+		table = built;
+		index_tables[ploidy].store(table, std::memory_order_release);
+	}
+	return table;
+}
+
 //check out http://genome.sph.umich.edu/wiki/Relationship_between_Ploidy,_Alleles_and_Genotypes
 void Genotype::enumerate_gts(std::vector<Genotype> &v, int stopallele, unsigned int ploidy, std::string genotype){
 	if (genotype.length() == ploidy){
@@ -43,12 +113,12 @@ void Genotype::enumerate_gts(std::vector<Genotype> &v, int stopallele, unsigned
 	}
 }
 
-double Genotype::p_finite_alleles(char ref, double ref_weight, double theta, std::map<char,double> pi){
+double Genotype::p_finite_alleles(char ref, double ref_weight, double theta, std::map<char,double> pi) const{
 	double p = 1;
 	int numalleles = 0;
-	for (auto it = gt.begin(); it != gt.end(); ++it){
-		char allele = it->first;
-		int count = it->second;
+	for (size_t a = 0; a < Genotype::numalleles; ++a){
+		char allele = alleles[a];
+		int count = counts[a];
 		for (int i = 0; i < count; ++i){
 			// p *= (w + theta * pi[allele] + i) / (w + theta + numalleles);
 			p *= (Popstatem::allele_alpha(allele,ref,ref_weight,theta,pi) + i) / (Popstatem::ref_alpha(ref_weight,theta) + numalleles);
@@ -60,17 +130,29 @@ double Genotype::p_finite_alleles(char ref, double ref_weight, double theta, std
 
 
 
+int Genotype::allele_index(char allele){
+	switch(allele){
+		case 'A': return 0;
+		case 'T': return 1;
+		case 'G': return 2;
+		case 'C': return 3;
+		default: return -1;
+	}
+}
+
 std::vector<Genotype> Genotype::enumerate_gts(int ploidy){
 	std::vector<Genotype> v;
 	enumerate_gts(v,alleles.size(),ploidy,std::string());
 	return v;
 }
 
+//alleles in alphabetical order
 std::string Genotype::to_string() const{
 	std::string s;
-	for(auto it = gt.begin(); it != gt.end(); ++it){
-		s.append(it->second,it->first);
+	for (size_t a = 0; a < numalleles; ++a){
+		s.append(counts[a],alleles[a]);
 	}
+	std::sort(s.begin(), s.end());
 	return s;
 }
 
@@ -79,6 +161,10 @@ std::ostream& operator<<(std::ostream& os, const Genotype gt){
 }
 
 bool operator==(const Genotype& lhs, const Genotype& rhs){
-	return lhs.gt == rhs.gt;
+	return lhs.get_counts() == rhs.get_counts();
+}
+
+bool operator!=(const Genotype& lhs, const Genotype& rhs){
+	return !(lhs == rhs);
 }
 
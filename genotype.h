@@ -3,35 +3,47 @@
 
 #include <map>
 #include <vector>
+#include <array>
 #include <string>
 #include <iostream>
+#include <cstdint>
+#include <cstddef>
 
+//a genotype is the number of copies of each of alleles, so it is trivially copyable and compares as 4 bytes.
+//code() packs the counts into an int; index_table(ploidy) turns that into a position in enumerate_gts(ploidy).
 class Genotype{
+public:
+	static constexpr size_t numalleles = 4;
+	typedef std::array<uint8_t,numalleles> counts_t; //counts[i] = copies of alleles[i]
+	typedef std::vector<int> index_table_t; //code -> position in enumerate_gts(ploidy), -1 if the code isn't a genotype
+	static constexpr int max_table_ploidy = 32; //tables have (ploidy + 1)^4 entries
 protected:
+	counts_t counts;
 	int ploidy;
 	static void enumerate_gts(std::vector<Genotype> &v, int stopallele, unsigned int ploidy, std::string genotype);
 public:
-	std::map<char,int> gt;
 	Genotype(std::string gtstr);
 	Genotype(std::map<char,int> gt);
-	double p_finite_alleles(char ref, double ref_weight, double theta, std::map<char,double> pi);
-	int numbase(char n);
-	int numnotbase(char n);
-	int getploidy();
+	Genotype(const counts_t &counts);
+	Genotype();
+	double p_finite_alleles(char ref, double ref_weight, double theta, std::map<char,double> pi) const;
+	int numbase(char n) const; //0 for anything that isn't one of alleles
+	int numnotbase(char n) const;
+	int count(size_t allele) const {return counts[allele];}; //copies of alleles[allele]
+	const counts_t &get_counts() const {return counts;};
+	int getploidy() const;
+	int code() const; //sum of counts[i] * (ploidy + 1)^i; unique among genotypes of one ploidy
+	int index() const; //position in enumerate_gts(ploidy)
+	int index(const index_table_t &table) const {return table[code()];}; //table must be *index_table(ploidy); for callers that look it up once
 	std::string to_string() const;
 	static std::vector<Genotype> enumerate_gts(int ploidy);
+	static const index_table_t *index_table(int ploidy); //built on first use, then never changed or freed. throws std::out_of_range past max_table_ploidy.
+	static int allele_index(char allele); //index into alleles, or -1 if not a valid base
 	static const std::vector<char> alleles;
-	static constexpr size_t numalleles = 4;
 };
 
 std::ostream& operator<<(std::ostream& os, const Genotype);
 bool operator==(const Genotype& lhs, const Genotype& rhs);
+bool operator!=(const Genotype& lhs, const Genotype& rhs);
 
 #endif
-
-
-
-
-
-
-
@@ -0,0 +1,135 @@
+#include "gl_table.h"
+#include "seqem.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+GL_Table::GL_Table(const std::vector<Genotype> &gts, double epsilon) : ngts(gts.size()), logp(), logprior(gts.size(), 0.0), s_index() {
+	build(gts, epsilon);
+}
+
+GL_Table::GL_Table(const std::vector<Genotype> &gts, double epsilon, const std::map<char,double> &pi) : ngts(gts.size()), logp(), logprior(), s_index() {
+	build(gts, epsilon);
+	for (const Genotype &g : gts){
+		logprior.push_back(Seqem::pg(g, pi));
+	}
+}
+
+//entries come from Seqem::pn_given_gtheta and Seqem::calc_s, so the table can't drift from the model
+void GL_Table::build(const std::vector<Genotype> &gts, double epsilon){
+	logp.reserve(ngts * Genotype::numalleles);
+	s_index.reserve(ngts * Genotype::numalleles);
+	for (const Genotype &g : gts){
+		for (size_t a = 0; a < Genotype::numalleles; ++a){
+			logp.push_back(Seqem::pn_given_gtheta(Genotype::alleles[a], g, std::make_tuple(epsilon)));
+			allelecounts_t unit = {};
+			unit[a] = 1;
+			std::vector<double> s = Seqem::calc_s(unit, g);
+			int k = -1;
+			for (size_t i = 0; i < s.size(); ++i){
+				if (s[i] != 0){
+					k = i;
+				}
+			}
+			s_index.push_back(k);
+		}
+	}
+}
+
+size_t GL_Table::num_gts() const{
+	return ngts;
+}
+
+const double *GL_Table::row(size_t g) const{
+	return logp.data() + g * Genotype::numalleles;
+}
+
+double GL_Table::dot(const allelecounts_t &x, const double *row){
+	double px = 0.0;
+	for (size_t a = 0; a < Genotype::numalleles; ++a){
+		px += (x[a] == 0 ? 0.0 : x[a] * row[a]);
+	}
+	return px;
+}
+
+double GL_Table::loglikelihood(const allelecounts_t &x, size_t g) const{
+	return dot(x, row(g));
+}
+
+template<size_t NGTS>
+static void fixed_loglikelihoods(const double *logp, const allelecounts_t &x, double *out){
+	for (size_t g = 0; g < NGTS; ++g){
+		out[g] = GL_Table::dot(x, logp + g * Genotype::numalleles);
+	}
+}
+
+//the number of genotypes is a compile time constant for ploidy 1, 2, 4 and 6 so the loop unrolls
+void GL_Table::loglikelihoods(const allelecounts_t &x, double *out) const{
+	const double *p = logp.data();
+	switch(ngts){
+		case 4: fixed_loglikelihoods<4>(p, x, out); break;
+		case 10: fixed_loglikelihoods<10>(p, x, out); break;
+		case 35: fixed_loglikelihoods<35>(p, x, out); break;
+		case 84: fixed_loglikelihoods<84>(p, x, out); break;
+		default:
+			for (size_t g = 0; g < ngts; ++g){
+				out[g] = dot(x, p + g * Genotype::numalleles);
+			}
+	}
+}
+
+void GL_Table::loglikelihoods(const allelecounts_t *x, size_t n, double *out) const{
+	for (size_t i = 0; i < n; ++i){
+		loglikelihoods(x[i], out + i * ngts);
+	}
+}
+
+void GL_Table::joint(const allelecounts_t &x, double *out) const{
+	loglikelihoods(x, out);
+	for (size_t g = 0; g < ngts; ++g){
+		out[g] = std::exp(out[g] + logprior[g]);
+	}
+}
+
+double GL_Table::posteriors(const allelecounts_t &x, double *out) const{
+	loglikelihoods(x, out);
+	for (size_t g = 0; g < ngts; ++g){
+		out[g] += logprior[g];
+	}
+	return normalize(out, ngts);
+}
+
+//log P(x, g) - max_g log P(x, g) is 0 for the most likely genotype, so its exp can't underflow
+//however deep the site is; the max is added back to get log P(x).
+double GL_Table::normalize(double *logp, size_t n){
+	double max = -std::numeric_limits<double>::infinity();
+	for (size_t g = 0; g < n; ++g){
+		max = std::max(max, logp[g]);
+	}
+	if (max == -std::numeric_limits<double>::infinity()){
+		std::fill(logp, logp + n, 0.0);
+		return max;
+	}
+	double sum = 0.0;
+	for (size_t g = 0; g < n; ++g){
+		logp[g] = std::exp(logp[g] - max);
+		sum += logp[g];
+	}
+	for (size_t g = 0; g < n; ++g){
+		logp[g] /= sum;
+	}
+	return max + std::log(sum);
+}
+
+void GL_Table::add_s(std::vector<double> &s, const allelecounts_t &x, size_t g, double weight) const{
+	add_s(s.data(), x, g, weight);
+}
+
+void GL_Table::add_s(double *s, const allelecounts_t &x, size_t g, double weight) const{
+	const int *idx = s_index.data() + g * Genotype::numalleles;
+	for (size_t a = 0; a < Genotype::numalleles; ++a){
+		if (idx[a] >= 0){
+			s[idx[a]] += weight * x[a];
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef __MEEP_GL_TABLE_INCLUDED__
+#define __MEEP_GL_TABLE_INCLUDED__
+
+#include <vector>
+#include <map>
+#include <cstddef>
+#include "genotype.h"
+#include "plpdata.h"
+
+//log P(base | genotype) for every genotype and allele at one epsilon, built once per EM iteration.
+//genotype likelihoods for a site are then a count vector times table product instead of a map lookup
+//and a log per base per genotype. rows are contiguous and fixed width so the loops vectorize.
+//works for any ploidy; the genotype loop is unrolled for ploidy 1, 2, 4 and 6.
+class GL_Table{
+protected:
+	size_t ngts;
+	std::vector<double> logp; //ngts x numalleles, row major
+	std::vector<double> logprior; //log P(g); all 0 without pi
+	std::vector<int> s_index; //ngts x numalleles; where Seqem::calc_s counts allele a for genotype g, -1 if nowhere
+	void build(const std::vector<Genotype> &gts, double epsilon);
+public:
+	GL_Table(const std::vector<Genotype> &gts, double epsilon);
+	GL_Table(const std::vector<Genotype> &gts, double epsilon, const std::map<char,double> &pi);
+	size_t num_gts() const;
+	const double *row(size_t g) const;
+	double loglikelihood(const allelecounts_t &x, size_t g) const; //log P(x | g)
+	void loglikelihoods(const allelecounts_t &x, double *out) const; //out[g] = log P(x | g) for every g
+	void loglikelihoods(const allelecounts_t *x, size_t n, double *out) const; //n sites; out is n x num_gts
+	void joint(const allelecounts_t &x, double *out) const; //out[g] = P(g, x), not log space
+	double posteriors(const allelecounts_t &x, double *out) const; //out[g] = P(g | x); returns log P(x). doesn't underflow at deep sites
+	void add_s(std::vector<double> &s, const allelecounts_t &x, size_t g, double weight) const; //s += weight * Seqem::calc_s(x, g)
+	void add_s(double *s, const allelecounts_t &x, size_t g, double weight) const; //s has ploidy + 1 entries
+	static double normalize(double *logp, size_t n); //log P(x, g) -> P(g | x) in place; returns log P(x). the largest term is scaled to 1 first
+	static double dot(const allelecounts_t &x, const double *row); //0 counts contribute 0 even when row is -inf
+};
+
+#endif
@@ -5,23 +5,27 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <stdexcept>
 
 GT_Matrix::GT_Matrix(): GT_Matrix(2) {}
 
-GT_Matrix::GT_Matrix(int ploidy): ploidy(ploidy), gts(Genotype::enumerate_gts(ploidy)), data(Genotype::alleles.size(),std::vector<double>(gts.size(),0.0)) {
+GT_Matrix::GT_Matrix(int ploidy): ploidy(ploidy), gts(Genotype::enumerate_gts(ploidy)), ncols(gts.size()), data(Genotype::alleles.size() * ncols, 0.0), gt_index(Genotype::index_table(ploidy)) {
 }
 
-GT_Matrix::GT_Matrix(std::string filename, int ploidy):
-ploidy(ploidy), gts(Genotype::enumerate_gts(ploidy)), data(Genotype::alleles.size(),std::vector<double>(gts.size())){
+//one tab separated row per allele
+GT_Matrix::GT_Matrix(std::string filename, int ploidy): GT_Matrix(ploidy) {
 	std::ifstream f;
-	f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+	f.exceptions ( std::ifstream::badbit );
 	f.open(filename);
-	int i = 0;
-	for(std::string line; std::getline(f,line);){
+	if (!f.is_open()){
+		throw std::runtime_error("error opening " + filename);
+	}
+	size_t i = 0;
+	for(std::string line; i < rows() && std::getline(f,line); ++i){
 		std::istringstream row(line);
-		int j = 0;
-		for(std::string val; std::getline(row,val,'\t');){
-			data[i][j] = std::stod(val);
+		size_t j = 0;
+		for(std::string val; j < ncols && std::getline(row,val,'\t'); ++j){
+			(*this)(i,j) = std::stod(val);
 		}
 	}
 	f.close();
@@ -42,29 +46,38 @@ ploidy(ploidy), gts(Genotype::enumerate_gts(ploidy)), data(Genotype::alleles.siz
 // 	}
 // }
 
-const std::vector<double>& GT_Matrix::operator[](char allele) const{
-	return data[std::distance(Genotype::alleles.begin(),std::find(Genotype::alleles.begin(), Genotype::alleles.end(), allele))];
+//genotypes are enumerate_gts(ploidy), so Genotype::index is their column
+const double *GT_Matrix::operator[](char allele) const{
+	return (*this)[(size_t)Genotype::allele_index(allele)];
 }
 
 double GT_Matrix::operator()(char allele, Genotype gt) const{
-	std::vector<double> row = data[std::distance(Genotype::alleles.begin(),std::find(Genotype::alleles.begin(), Genotype::alleles.end(), allele))];
-	ptrdiff_t idx = std::distance(gts.begin(),std::find(gts.begin(), gts.end(), gt));
-	return row[idx];
+	return (*this)(Genotype::allele_index(allele), gt.index(*gt_index));
 }
 
 double& GT_Matrix::operator()(char allele, Genotype gt){
-	std::vector<double>& row = data[std::distance(Genotype::alleles.begin(),std::find(Genotype::alleles.begin(), Genotype::alleles.end(), allele))];
-	ptrdiff_t idx = std::distance(gts.begin(),std::find(gts.begin(), gts.end(), gt));
-	return row[idx];
+	return (*this)(Genotype::allele_index(allele), gt.index(*gt_index));
 }
 
-std::ostream& operator<<(std::ostream& os, const GT_Matrix m){
+GT_Matrix &GT_Matrix::operator+=(const GT_Matrix &other){
+	if (other.data.size() != data.size()){
+		throw std::invalid_argument("can't add GT_Matrix of ploidy " + std::to_string(other.ploidy) + " to one of ploidy " + std::to_string(ploidy));
+	}
+	for (size_t i = 0; i < data.size(); ++i){
+		data[i] += other.data[i];
+	}
+	return *this;
+}
+
+std::ostream& operator<<(std::ostream& os, const GT_Matrix &m){
 	os << "- gt_matrix - " << std::endl;
 	os << "GTs : " << m.gts << std::endl;
-	for(int i = 0; i < Genotype::alleles.size(); ++i){
-		os << Genotype::alleles[i] << " : ";
-		os << m[i] << std::endl;
+	for(size_t i = 0; i < m.rows(); ++i){
+		os << Genotype::alleles[i] << " : [ ";
+		for (size_t j = 0; j < m.cols(); ++j){
+			os << (j == 0 ? "" : ", ") << m(i,j);
+		}
+		os << " ]" << std::endl;
 	}
 	return os << "----------" << std::endl;
 }
-
@@ -6,34 +6,44 @@
 #include "genotype.h"
 #include "tuple_print.h"
 #include <iostream>
+#include <vector>
+#include <cstddef>
 
 //no reason for arrays over vectors:
 //https://stackoverflow.com/questions/381621/using-arrays-or-stdvectors-in-c-whats-the-performance-gap
 //cool faq on matrix classes:
 //https://isocpp.org/wiki/faq/operator-overloading#matrix-subscript-op
 //TODO: make a Matrix class, then a GT_Matrix class for allele+genotype based access, then make ctor a simple function in popstatem
+//one row per reference allele, one column per genotype in enumerate_gts(ploidy), in a single row-major buffer.
+//rows come back as pointers, so m[i][j] never copies.
 class GT_Matrix{
 protected:
 	int ploidy;
 	std::vector<Genotype> gts;
-	std::vector<std::vector<double>> data;
+	size_t ncols;
+	std::vector<double> data;
+	const Genotype::index_table_t *gt_index; //Genotype::index_table(ploidy), looked up once
 public:
-	friend std::ostream& operator<<(std::ostream& os, const GT_Matrix);
-	std::vector<double> operator[](size_t i) const {return data[i];};
-	std::vector<double> operator[](int i) const {return data[i];};
-	std::vector<double> &operator[](size_t i) {return data[i];};
-	std::vector<double> &operator[](int i) {return data[i];};
-	const std::vector<double> &operator[](char allele) const;
+	friend std::ostream& operator<<(std::ostream& os, const GT_Matrix &m);
+	const double *operator[](size_t i) const {return data.data() + i * ncols;};
+	const double *operator[](int i) const {return data.data() + i * ncols;};
+	double *operator[](size_t i) {return data.data() + i * ncols;};
+	double *operator[](int i) {return data.data() + i * ncols;};
+	const double *operator[](char allele) const;
 	double operator()(char allele, Genotype gt) const;
-	double operator()(size_t i, size_t j) const {return data[i][j];};
+	double operator()(size_t i, size_t j) const {return data[i * ncols + j];};
 	double &operator()(char allele, Genotype gt);
-	double &operator()(size_t i, size_t j) {return data[i][j];};
+	double &operator()(size_t i, size_t j) {return data[i * ncols + j];};
+	GT_Matrix &operator+=(const GT_Matrix &other); //element-wise; other must have the same ploidy
+	size_t rows() const {return Genotype::numalleles;};
+	size_t cols() const {return ncols;};
+	const std::vector<Genotype> &genotypes() const {return gts;};
 	GT_Matrix();
 	GT_Matrix(int ploidy);
 	GT_Matrix(std::string filename, int ploidy);
 	// GT_Matrix(Pileupdata plpdata, int ploidy, theta_t theta, std::map<char,double> pi);
 };
 
-std::ostream& operator<<(std::ostream& os, const GT_Matrix);
+std::ostream& operator<<(std::ostream& os, const GT_Matrix &m);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "htspool.h"
+#include <stdexcept>
+#include <cstdlib>
+
+int HtsPool::nthreads = 0;
+htsThreadPool *HtsPool::pool = nullptr;
+
+void HtsPool::set_threads(int n){
+	if (pool != nullptr){
+		throw std::logic_error("set the number of htslib threads before opening any files");
+	}
+	nthreads = (n < 0 ? 0 : n);
+}
+
+int HtsPool::get_threads(){
+	return nthreads;
+}
+
+htsThreadPool *HtsPool::get(){
+	if (nthreads == 0){
+		return nullptr;
+	}
+	if (pool == nullptr){
+		hts_tpool *p = hts_tpool_init(nthreads);
+		if (p == nullptr){
+			throw std::runtime_error("error creating htslib thread pool");
+		}
+		pool = new htsThreadPool();
+		pool->pool = p;
+		pool->qsize = 0;
+		std::atexit(&HtsPool::destroy);
+	}
+	return pool;
+}
+
+void HtsPool::attach(htsFile *fp){
+	htsThreadPool *p = get();
+	if (p != nullptr && hts_set_thread_pool(fp, p) != 0){
+		throw std::runtime_error("error attaching htslib thread pool");
+	}
+}
+
+void HtsPool::destroy(){
+	if (pool != nullptr){
+		hts_tpool_destroy(pool->pool);
+		delete pool;
+		pool = nullptr;
+	}
+}
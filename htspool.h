@@ -0,0 +1,22 @@
+#ifndef __MEEP_HTSPOOL_INCLUDED__
+#define __MEEP_HTSPOOL_INCLUDED__
+
+#include <htslib/hts.h>
+#include <htslib/thread_pool.h>
+
+//one htslib thread pool shared by every file we open, so BGZF/CRAM (de)compression
+//runs alongside pileup and EM instead of on the main thread.
+//the pool is created the first time a file is attached; 0 threads (the default) means no pool.
+class HtsPool{
+protected:
+	static int nthreads;
+	static htsThreadPool *pool;
+	static void destroy();
+public:
+	static void set_threads(int n); //call before opening any files. throws if the pool already exists.
+	static int get_threads();
+	static htsThreadPool *get(); //nullptr if there are no threads
+	static void attach(htsFile *fp); //no-op without threads. throws.
+};
+
+#endif
@@ -4,9 +4,18 @@
 #include <iostream>
 #include <cmath>
 #include "meep_math.h"
+#include "htspool.h"
+#include "parallel.h"
 
+//meep [-@ threads]; threads defaults to every hardware thread and is used both for
+//BGZF/CRAM decompression and for the E step
 int main(int argc, char *argv[]){
 	std::clog.precision(15);
+	int threads = meep_parallel::default_threads();
+	if (argc > 2 && std::string(argv[1]) == "-@"){
+		threads = std::stoi(argv[2]);
+	}
+	HtsPool::set_threads(threads); //before any file is opened
 
 	// Seqem seq("foo.sam","testdata/test.fa");
 	// std::vector<char> x(9,'C');
@@ -15,6 +24,7 @@ int main(int argc, char *argv[]){
 	// Seqem seq(data);
 
 	Popstatem seq("foo.sam","testdata/test.fa");
+	seq.set_threads(threads);
 	std::tuple<double, std::map<char,double>, double, double> result = seq.start(.00001);
 	std::cout << "Theta is: " << result << std::endl;
 
@@ -0,0 +1,492 @@
+#include "pileup.h"
+#include "seqem.h"
+#include "gl_table.h"
+#include "gt_matrix.h"
+#include "popstatem.h"
+#include "htspool.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cmath>
+
+//pileup throughput for each alignment file against one reference, e.g. the same reads as BAM and CRAM:
+//	meep_bench pileup testdata/test.fa foo.bam foo.cram
+int bench_pileup(std::string reffile, std::string samfile){
+	auto start = std::chrono::steady_clock::now();
+	Pileup p(samfile, reffile);
+	size_t sites = 0;
+	size_t bases = 0;
+	int val;
+	while((val = p.next()) != 0){
+		if (val == 1){
+			++sites;
+			bases += p.alleles.size();
+		}
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << samfile << "\t" << sites << " sites\t" << bases << " bases\t" << secs << " s\t" << bases / secs << " bases/s" << std::endl;
+	return 0;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//one Pileup pass per sample against one MultiPileup pass over all of them:
+//	meep_bench mpileup testdata/test.fa a.bam b.bam c.bam
+int bench_mpileup(std::string reffile, std::vector<std::string> samfiles){
+	auto start = std::chrono::steady_clock::now();
+	size_t bases = 0;
+	for (const std::string &samfile : samfiles){
+		Pileup p(samfile, reffile);
+		int val;
+		while((val = p.next()) != 0){
+			if (val == 1){
+				bases += p.alleles.size();
+			}
+		}
+	}
+	double separate = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	size_t multi_bases = 0;
+	size_t sites = 0;
+	MultiPileup m(samfiles, reffile);
+	int val;
+	while((val = m.next()) != 0){
+		if (val == 1){
+			++sites;
+			for (const std::vector<char> &a : m.alleles){
+				multi_bases += a.size();
+			}
+		}
+	}
+	double multi = seconds_since(start);
+
+	std::cout << "per sample\t" << separate << " s\t" << bases << " bases" << std::endl;
+	std::cout << "MultiPileup\t" << multi << " s\t" << multi_bases << " bases\t" << sites << " sites" << std::endl;
+	std::cout << "speedup\t" << separate / multi << std::endl;
+	return 0;
+}
+
+//random site patterns around depth 30: mostly one allele plus a few errors
+std::vector<allelecounts_t> random_patterns(size_t n){
+	std::mt19937 rng(1);
+	std::poisson_distribution<int> depth(30);
+	std::uniform_int_distribution<int> allele(0, Genotype::numalleles - 1);
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<allelecounts_t> patterns(n);
+	for (allelecounts_t &x : patterns){
+		x = {};
+		int major = allele(rng);
+		for (int d = depth(rng); d > 0; --d){
+			++x[u(rng) < 0.95 ? major : allele(rng)];
+		}
+	}
+	return patterns;
+}
+
+//P(x) over every diploid genotype, per base with Seqem::pn_given_gtheta as EM did before GL_Table,
+//and with one GL_Table per pass
+int bench_gl(size_t n, int reps){
+	std::vector<allelecounts_t> patterns = random_patterns(n);
+	std::vector<Genotype> gts = Genotype::enumerate_gts(2);
+	double epsilon = 0.01;
+
+	auto start = std::chrono::steady_clock::now();
+	double per_base_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		for (const allelecounts_t &x : patterns){
+			for (const Genotype &g : gts){
+				double px = 0.0;
+				for (size_t a = 0; a < Genotype::numalleles; ++a){
+					if (x[a] != 0){
+						px += x[a] * Seqem::pn_given_gtheta(Genotype::alleles[a], g, std::make_tuple(epsilon));
+					}
+				}
+				per_base_total += std::exp(px + Seqem::pg(g, Seqem::uniform_pi));
+			}
+		}
+	}
+	double per_base = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	double table_total = 0.0;
+	std::vector<double> pg_x(gts.size());
+	for (int r = 0; r < reps; ++r){
+		GL_Table table(gts, epsilon, Seqem::uniform_pi);
+		for (const allelecounts_t &x : patterns){
+			table.joint(x, pg_x.data());
+			for (double p : pg_x){
+				table_total += p;
+			}
+		}
+	}
+	double table = seconds_since(start);
+
+	std::cout << "per base\t" << per_base << " s\t" << per_base_total << std::endl;
+	std::cout << "GL_Table\t" << table << " s\t" << table_total << std::endl;
+	std::cout << "speedup\t" << per_base / table << std::endl;
+	return 0;
+}
+
+//GT_Matrix as it was before it was flattened: a vector per allele, found with std::find,
+//and rows copied out by the const accessors
+struct Nested_gt_matrix{
+	std::vector<Genotype> gts;
+	std::vector<std::vector<double>> data;
+	Nested_gt_matrix(int ploidy) : gts(Genotype::enumerate_gts(ploidy)), data(Genotype::alleles.size(), std::vector<double>(gts.size(), 0.0)) {}
+	std::vector<double> operator[](size_t i) const {return data[i];};
+	double operator()(char allele, Genotype gt) const{
+		size_t i = std::find(Genotype::alleles.begin(), Genotype::alleles.end(), allele) - Genotype::alleles.begin();
+		size_t j = std::find(gts.begin(), gts.end(), gt) - gts.begin();
+		return (*this)[i][j];
+	}
+	double &operator()(char allele, Genotype gt){
+		size_t i = std::find(Genotype::alleles.begin(), Genotype::alleles.end(), allele) - Genotype::alleles.begin();
+		size_t j = std::find(gts.begin(), gts.end(), gt) - gts.begin();
+		return data[i][j];
+	}
+};
+
+//the access pattern of the Popstatem E and M steps: accumulate into every (allele, genotype) cell,
+//merge per-chunk partials, then read every cell back by allele and genotype
+template<typename M>
+double gtmatrix_pass(int ploidy, int chunks){
+	std::vector<Genotype> gts = Genotype::enumerate_gts(ploidy);
+	M total(ploidy);
+	for (int c = 0; c < chunks; ++c){
+		M partial(ploidy);
+		for (char allele : Genotype::alleles){
+			for (const Genotype &g : gts){
+				partial(allele, g) += 1.0 / (1 + c);
+			}
+		}
+		for (char allele : Genotype::alleles){
+			for (const Genotype &g : gts){
+				total(allele, g) += partial(allele, g);
+			}
+		}
+	}
+	const M &m = total;
+	double sum = 0.0;
+	for (char allele : Genotype::alleles){
+		for (const Genotype &g : gts){
+			sum += m(allele, g);
+		}
+	}
+	return sum;
+}
+
+//the same reduction with GT_Matrix's += merge
+double gtmatrix_merge_pass(int ploidy, int chunks){
+	std::vector<Genotype> gts = Genotype::enumerate_gts(ploidy);
+	GT_Matrix total(ploidy);
+	for (int c = 0; c < chunks; ++c){
+		GT_Matrix partial(ploidy);
+		for (size_t i = 0; i < partial.rows(); ++i){
+			double *row = partial[i];
+			for (size_t j = 0; j < partial.cols(); ++j){
+				row[j] += 1.0 / (1 + c);
+			}
+		}
+		total += partial;
+	}
+	const GT_Matrix &m = total;
+	double sum = 0.0;
+	for (char allele : Genotype::alleles){
+		for (const Genotype &g : gts){
+			sum += m(allele, g);
+		}
+	}
+	return sum;
+}
+
+int bench_gtmatrix(int ploidy, int reps){
+	int chunks = 64;
+	auto start = std::chrono::steady_clock::now();
+	double nested_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		nested_total += gtmatrix_pass<Nested_gt_matrix>(ploidy, chunks);
+	}
+	double nested = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	double flat_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		flat_total += gtmatrix_pass<GT_Matrix>(ploidy, chunks);
+	}
+	double flat = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	double merge_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		merge_total += gtmatrix_merge_pass(ploidy, chunks);
+	}
+	double merge = seconds_since(start);
+
+	std::cout << "nested\t" << nested << " s\t" << nested_total << std::endl;
+	std::cout << "flat\t" << flat << " s\t" << flat_total << std::endl;
+	std::cout << "flat +=\t" << merge << " s\t" << merge_total << std::endl;
+	std::cout << "speedup\t" << nested / flat << "\t" << nested / merge << std::endl;
+	return 0;
+}
+
+//the Popstatem derivatives as they were before Alpha_table: one pass over the GT_Matrix per derivative
+double old_dq_dtheta(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, double th){
+	std::map<char,double> pi = std::get<1>(theta);
+	double refweight = std::get<2>(theta);
+	double dq = 0.0;
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			const Genotype &g = possible_gts[j];
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				for (int k = 0; k < g.count(a_i); ++k){ //add pi/(alpha + 0) twice for het; pi/(alpha + 1) for homozygote
+					dq += m[i][j] * (pi[allele]/(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k));
+				}
+			}
+			for (int l = 0; l < ploidy; ++l){ //subtract alpha, alpha + 1
+				dq -= m[i][j] * (1.0 / (Popstatem::ref_alpha(refweight, th) + l));	
+			}
+		}
+	}
+	return dq;
+}
+
+double old_ddq_dtheta(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, double th){
+	double ddq = 0.0;
+	std::map<char,double> pi = std::get<1>(theta);
+	double refweight = std::get<2>(theta);
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			Genotype g = possible_gts[j];
+			for (int l = 0; l < ploidy; ++l){ //add  1/alpha, 1/(alpha + 1)
+				ddq += m[i][j] * (1.0 / pow(Popstatem::ref_alpha(refweight, th) + l,2));	
+			}
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				for (int k = 0; k < g.count(a_i); ++k){ //add pi/(alpha + 0) twice for het; pi/(alpha + 1) for homozygote
+					ddq -= m[i][j] * (pow(pi[allele],2)/pow(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k,2));
+				}
+			}
+		}
+	}
+	return ddq;
+}
+
+double old_dq_dw(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, double w){
+	double dq = 0.0;
+	double th = std::get<0>(theta);
+	std::map<char,double> pi = std::get<1>(theta);
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			const Genotype &g = possible_gts[j];
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				if (allele == Genotype::alleles[i]){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						dq += m[i][j] * (1.0/(Popstatem::allele_alpha(allele,(char)Genotype::alleles[i],w,th,pi) + k));
+					}
+				}
+			}
+			for (int l = 0; l < ploidy; ++l){ //subtract 1/(w + theta + l); the alphas sum to w + theta
+				dq -= m[i][j] * (1.0 / (Popstatem::ref_alpha(w, th) + l));
+			}
+		}
+	}
+	return dq;	
+}
+
+double old_ddq_dw(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, double w){
+	double ddq = 0.0;
+	double th = std::get<0>(theta);
+	std::map<char,double> pi = std::get<1>(theta);
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			const Genotype &g = possible_gts[j];
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				if (allele == Genotype::alleles[i]){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						ddq -= m[i][j] * (1.0/pow(Popstatem::allele_alpha(allele,(char)Genotype::alleles[i],w,th,pi) + k,2));
+					}
+				}
+			}
+			for (int l = 0; l < ploidy; ++l){
+				ddq += m[i][j] * (1.0 / pow(Popstatem::ref_alpha(w, th) + l,2));
+			}
+		}
+	}
+	return ddq;	
+}
+
+double old_dq_dpi(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, char a, double pi){
+	double dq = 0.0;
+	double th = std::get<0>(theta);
+	std::map<char,double> p = std::get<1>(theta);
+	double refweight = std::get<2>(theta);
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	double pi_last = 1.0;
+	for (int i = 0; i < numalleles - 1; ++i){
+		char allele = Genotype::alleles[i];
+		pi_last -= (allele == a ? pi : p[allele]);
+	}
+	// pi_last = (pi_last < 0 ? 0 : pi_last);
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			const Genotype &g = possible_gts[j];
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				if (allele == a){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						dq += m[i][j] * th /(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k);
+					}
+				}
+				else if(allele == Genotype::alleles.back()){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						dq -= m[i][j] * th /(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi_last) + k);
+					}	
+				}
+			}
+		}
+	}
+	return dq;	
+}
+
+double old_ddq_dpi(const GT_Matrix &m, const std::vector<Genotype> &possible_gts, int ploidy, const Popstatem::theta_t &theta, char a, double pi){
+	double ddq = 0.0;
+	double th = std::get<0>(theta);
+	std::map<char,double> p = std::get<1>(theta);
+	double refweight = std::get<2>(theta);
+	int numalleles = Genotype::alleles.size();
+	int numgts = possible_gts.size();
+	double pi_last = 1.0;
+	for (int i = 0; i < numalleles - 1; ++i){
+		char allele = Genotype::alleles[i];
+		pi_last -= (allele == a ? pi : p[allele]);
+	}
+	// pi_last = (pi_last < 0 ? 0 : pi_last);
+	for (int i = 0; i < numalleles; ++i){ //for each reference base
+		for (int j = 0; j < numgts; ++j){ //for each genotype
+			const Genotype &g = possible_gts[j];
+			for (size_t a_i = 0; a_i < Genotype::numalleles; ++a_i){ //for each base in genotype
+				char allele = Genotype::alleles[a_i];
+				if (allele == a){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						ddq -= m[i][j] * pow(th,2) / pow(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k,2);
+					}
+				}
+				else if (allele == Genotype::alleles.back()){
+					for (int k = 0; k < g.count(a_i); ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
+						ddq -= m[i][j] * pow(th,2) / pow(Popstatem::allele_alpha(allele,Genotype::alleles[i],refweight,th,pi_last) + k,2);
+					}
+				}
+			}
+		}
+	}
+	return ddq;	
+}
+
+//the six single coordinate derivatives one Newton step needed before Alpha_table, against one
+//Alpha_table::evaluate that returns the whole gradient and hessian. the table is built once per M step.
+int bench_alpha(int ploidy, int reps){
+	std::vector<Genotype> gts = Genotype::enumerate_gts(ploidy);
+	GT_Matrix m(ploidy);
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> u(0.0, 100.0);
+	for (size_t i = 0; i < m.rows(); ++i){
+		for (size_t j = 0; j < m.cols(); ++j){
+			m(i,j) = u(rng);
+		}
+	}
+	Popstatem::theta_t theta = std::make_tuple(2.0, Seqem::uniform_pi, 1.5, 0.01);
+	double th = std::get<0>(theta);
+	double w = std::get<2>(theta);
+
+	auto start = std::chrono::steady_clock::now();
+	double old_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		old_total += old_dq_dtheta(m, gts, ploidy, theta, th) + old_ddq_dtheta(m, gts, ploidy, theta, th);
+		old_total += old_dq_dw(m, gts, ploidy, theta, w) + old_ddq_dw(m, gts, ploidy, theta, w);
+		for (size_t a = 0; a < Genotype::numalleles - 1; ++a){
+			char allele = Genotype::alleles[a];
+			old_total += old_dq_dpi(m, gts, ploidy, theta, allele, std::get<1>(theta)[allele]) + old_ddq_dpi(m, gts, ploidy, theta, allele, std::get<1>(theta)[allele]);
+		}
+	}
+	double old_secs = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	Popstatem::Alpha_table table(m, gts, ploidy);
+	double build_secs = seconds_since(start);
+	Popstatem::mparams_t x = Popstatem::to_mparams(theta);
+	Popstatem::mparams_t grad;
+	Popstatem::mhessian_t hess;
+	start = std::chrono::steady_clock::now();
+	double table_total = 0.0;
+	for (int r = 0; r < reps; ++r){
+		table.evaluate(x, &grad, &hess);
+		for (size_t p = 0; p < Popstatem::num_mparams; ++p){
+			table_total += grad[p] + hess[p][p];
+		}
+	}
+	double table_secs = seconds_since(start);
+
+	std::cout << "per derivative\t" << old_secs << " s\t" << old_total << std::endl;
+	std::cout << "Alpha_table\t" << table_secs << " s (+ " << build_secs << " s to build)\t" << table_total << std::endl;
+	std::cout << "speedup\t" << old_secs / table_secs << std::endl;
+	return 0;
+}
+
+int usage(){
+	std::cerr << "usage: meep_bench [-@ htslib threads] <mode> ..." << std::endl;
+	std::cerr << "       meep_bench pileup <ref.fa> <reads.{sam,bam,cram}>..." << std::endl;
+	std::cerr << "       meep_bench mpileup <ref.fa> <reads.{sam,bam,cram}>..." << std::endl;
+	std::cerr << "       meep_bench gl [sites] [passes]" << std::endl;
+	std::cerr << "       meep_bench gtmatrix [ploidy] [passes]" << std::endl;
+	std::cerr << "       meep_bench alpha [ploidy] [newton steps]" << std::endl;
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	if (argc > 2 && std::string(argv[1]) == "-@"){
+		HtsPool::set_threads(std::stoi(argv[2])); //0, the default, decompresses on the reading thread
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 2){
+		return usage();
+	}
+	std::string mode(argv[1]);
+	if (mode == "pileup" && argc >= 4){
+		for (int i = 3; i < argc; ++i){
+			bench_pileup(argv[2], argv[i]);
+		}
+		return 0;
+	}
+	if (mode == "mpileup" && argc >= 4){
+		return bench_mpileup(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	}
+	if (mode == "gl"){
+		return bench_gl(argc > 2 ? std::stoul(argv[2]) : 100000, argc > 3 ? std::stoi(argv[3]) : 10);
+	}
+	if (mode == "gtmatrix"){
+		return bench_gtmatrix(argc > 2 ? std::stoi(argv[2]) : 2, argc > 3 ? std::stoi(argv[3]) : 1000);
+	}
+	if (mode == "alpha"){
+		return bench_alpha(argc > 2 ? std::stoi(argv[2]) : 2, argc > 3 ? std::stoi(argv[3]) : 100000);
+	}
+	return usage();
+}
@@ -1,4 +1,5 @@
 #include <string>
+#include <cmath>
 #include "meep_math.h"
 
 namespace meep_math{
@@ -83,6 +84,43 @@ namespace meep_math{
 		return x;
 	}
 
+	//factor a = l l^T in place, then solve l y = b and l^T x = y
+	bool cholesky_solve(std::vector<double> a, const std::vector<double> &b, std::vector<double> &x){
+		size_t n = b.size();
+		for (size_t j = 0; j < n; ++j){
+			double d = a[j * n + j];
+			for (size_t k = 0; k < j; ++k){
+				d -= a[j * n + k] * a[j * n + k];
+			}
+			if (!(d > 0.0)){
+				return false;
+			}
+			d = std::sqrt(d);
+			a[j * n + j] = d;
+			for (size_t i = j + 1; i < n; ++i){
+				double v = a[i * n + j];
+				for (size_t k = 0; k < j; ++k){
+					v -= a[i * n + k] * a[j * n + k];
+				}
+				a[i * n + j] = v / d;
+			}
+		}
+		x.assign(b.begin(), b.end());
+		for (size_t i = 0; i < n; ++i){
+			for (size_t k = 0; k < i; ++k){
+				x[i] -= a[i * n + k] * x[k];
+			}
+			x[i] /= a[i * n + i];
+		}
+		for (size_t i = n; i-- > 0;){
+			for (size_t k = i + 1; k < n; ++k){
+				x[i] -= a[k * n + i] * x[k];
+			}
+			x[i] /= a[i * n + i];
+		}
+		return true;
+	}
+
 	//newton-raphson root finding DO NOT USE, DOESN'T WORK
 	double nr_root(std::function<double(double)> f, std::function<double(double)> f_prime, double init, double tolerance, int maxiter){
 		double x = init;
@@ -3,6 +3,7 @@
 #include <array>
 #include <functional>
 #include <complex>
+#include <vector>
 
 namespace meep_math{
 	double binomial_cdf(int successes, int trials, long double p);
@@ -10,6 +11,7 @@ namespace meep_math{
 	int binomial_coeff(int n, int k);
 	std::array<double,2> solve_quadratic(double a, double b, double c);
 	std::array<std::complex<double>,4> solve_quartic(double a, double b, double c, double d, double e);
+	bool cholesky_solve(std::vector<double> a, const std::vector<double> &b, std::vector<double> &x); //a is n x n, row major. false unless a is symmetric positive definite
 	double nr_root(std::function<double(double)> f, std::function<double(double)> f_prime, double init, double tolerance=.001, int maxiter=1000);
 }
 #endif
\ No newline at end of file
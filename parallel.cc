@@ -0,0 +1,63 @@
+#include "parallel.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <exception>
+#include <algorithm>
+
+namespace meep_parallel{
+	int default_threads(){
+		unsigned int n = std::thread::hardware_concurrency();
+		return (n == 0 ? 1 : n);
+	}
+
+	void parallel_for(size_t n, int nthreads, std::function<void(size_t, int)> f){
+		if (nthreads <= 1 || n <= 1){
+			for (size_t i = 0; i < n; ++i){
+				f(i, 0);
+			}
+			return;
+		}
+		nthreads = std::min<size_t>(nthreads, n); //don't spawn threads that would find no items
+		std::atomic<size_t> next(0);
+		std::exception_ptr error = nullptr;
+		std::mutex error_mutex;
+		auto worker = [&](int thread){
+			size_t i;
+			while ((i = next++) < n){
+				try{
+					f(i, thread);
+				}
+				catch(...){
+					std::lock_guard<std::mutex> lock(error_mutex);
+					if (error == nullptr){
+						error = std::current_exception();
+					}
+					next = n; //stop handing out work
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int t = 1; t < nthreads; ++t){
+			threads.emplace_back(worker, t);
+		}
+		worker(0);
+		for (std::thread &t : threads){
+			t.join();
+		}
+		if (error != nullptr){
+			std::rethrow_exception(error);
+		}
+	}
+
+	size_t num_chunks(size_t n, size_t chunk){
+		return (n + chunk - 1) / chunk;
+	}
+
+	void parallel_chunks(size_t n, int nthreads, std::function<void(size_t, size_t, size_t)> f, size_t chunk){
+		parallel_for(num_chunks(n, chunk), nthreads, [&](size_t c, int thread){
+			f(c, c * chunk, std::min(n, (c + 1) * chunk));
+		});
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef __MEEP_PARALLEL_INCLUDED__
+#define __MEEP_PARALLEL_INCLUDED__
+
+#include <functional>
+#include <cstddef>
+
+namespace meep_parallel{
+	int default_threads(); //number of hardware threads, at least 1
+	//call f(i, thread) for every i in [0,n) using nthreads threads. thread is in [0,nthreads).
+	//items are handed out in order; the first exception thrown by f is rethrown here.
+	void parallel_for(size_t n, int nthreads, std::function<void(size_t, int)> f);
+	const size_t default_chunk = 1024;
+	size_t num_chunks(size_t n, size_t chunk = default_chunk);
+	//call f(c, begin, end) for each chunk c = [begin,end) of [0,n). chunks don't depend on nthreads,
+	//so per-chunk results combined in chunk order come out the same for any number of threads.
+	void parallel_chunks(size_t n, int nthreads, std::function<void(size_t, size_t, size_t)> f, size_t chunk = default_chunk);
+}
+
+#endif
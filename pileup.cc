@@ -4,16 +4,19 @@
 #include <htslib/sam.h>
 #include <iostream>
 #include <algorithm>
+#include <stdexcept>
 
-Pileup::Pileup(std::string samfile, std::string reffile): reader(samfile), ref(reffile), tid(), pos(), cov(), pileup(nullptr), iter(), alleles(), qual(), names(), readgroups(), counts({{'A',0},{'T',0},{'G',0},{'C',0}}), ref_char()  {
-	iter = bam_plp_init(&Pileup::plp_get_read, &reader);
+Pileup::Pileup(std::string samfile, std::string reffile): reader(samfile), ref(reffile), tid(), pos(), cov(), pileup(nullptr), iter(), chr_tid(-1), chr_name(), alleles(), qual(), readgroups(), counts(), ref_char()  {
+	init_reader(reffile);
+	init_iter();
 }
 
-Pileup::Pileup(std::string samfile, std::string reffile, std::string region): reader(samfile, region), ref(reffile), tid(), pos(), cov(), pileup(nullptr), iter(), alleles(), qual(), names(), readgroups(), counts({{'A',0},{'T',0},{'G',0},{'C',0}}), ref_char() {
-	iter = bam_plp_init(&Pileup::plp_get_read, &reader);
+Pileup::Pileup(std::string samfile, std::string reffile, std::string region): reader(samfile, region), ref(reffile), tid(), pos(), cov(), pileup(nullptr), iter(), chr_tid(-1), chr_name(), alleles(), qual(), readgroups(), counts(), ref_char() {
+	init_reader(reffile);
+	init_iter();
 }
 
-Pileup::Pileup() : reader(nullptr), iter(nullptr) {
+Pileup::Pileup() : reader(nullptr), iter(nullptr), chr_tid(-1), filter() {
 }
 
 Pileup::~Pileup(){
@@ -22,40 +25,157 @@ Pileup::~Pileup(){
 	}
 }
 
+//CRAM is decoded against the same fasta we take reference bases from
+void Pileup::init_reader(std::string reffile){
+	reader.set_reference(reffile);
+}
+
+//(re)build the pileup for the current filter. overlapping mates are matched by name.
+void Pileup::init_iter(){
+	int fields = SamReader::pileup_fields;
+	if (filter.dedup_overlaps){
+		fields |= SamReader::mate_fields;
+	}
+	reader.set_required_fields(fields);
+	if (iter != nullptr){
+		bam_plp_destroy(iter);
+	}
+	iter = bam_plp_init(&Pileup::plp_get_read, this);
+	bam_plp_constructor(iter, &Pileup::plp_construct);
+	bam_plp_destructor(iter, &Pileup::plp_destruct);
+	bam_plp_set_maxcnt(iter, filter.max_depth);
+	if (filter.dedup_overlaps){
+		bam_plp_init_overlaps(iter);
+	}
+}
+
+Readdata *Readdata_pool::get(){
+	if (free.empty()){
+		owned.emplace_back(new Readdata());
+		free.push_back(owned.back().get());
+	}
+	Readdata *r = free.back();
+	free.pop_back();
+	return r;
+}
+
+void Readdata_pool::put(Readdata *r){
+	free.push_back(r);
+}
+
+Readfilter::Readfilter() : flag_mask(BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP), min_mapq(0), min_baseq(0), max_depth(8000), dedup_overlaps(true) {
+}
+
+bool Readfilter::keep(const bam1_t *b) const{
+	return (b->core.flag & flag_mask) == 0 && b->core.qual >= min_mapq;
+}
+
+void Pileup::set_filter(const Readfilter &f){
+	filter = f;
+	init_iter();
+}
+
+const Readfilter &Pileup::get_filter(){
+	return filter;
+}
+
+//reads still buffered for the old region are dropped along with the old pileup
+void Pileup::set_region(interval_t r){
+	reader.set_region(r);
+	init_iter();
+	pileup = nullptr;
+	cov = 0;
+}
+
 //typedef int (*bam_plp_auto_f)(void *data, bam1_t *b);
+//reads the filter rejects are skipped here, before the pileup sees them
 int Pileup::plp_get_read(void *data, bam1_t *b){
-	SamReader *reader = (SamReader*)data;
-	return reader->next(b);
+	Pileup *p = (Pileup*)data;
+	int r;
+	while ((r = p->reader.next(b)) >= 0 && !p->filter.keep(b)){
+	}
+	return r;
+}
+
+//the constructor sees a read before its mate is found, so quals still holds what the file says
+static Readdata *fill_readdata(Readdata *r, SamReader &reader, const bam1_t *b, const Readfilter &filter){
+	r->readgroup = reader.get_readgroup_id(b);
+	if (filter.dedup_overlaps){
+		const uint8_t *q = bam_get_qual(b);
+		r->quals.assign(q, q + b->core.l_qseq);
+	}
+	return r;
+}
+
+//called once when b enters the pileup
+int Pileup::plp_construct(void *data, const bam1_t *b, bam_pileup_cd *cd){
+	Pileup *p = (Pileup*)data;
+	cd->p = fill_readdata(p->readdata.get(), p->reader, b, p->filter);
+	return 0;
+}
+
+//called once when b leaves the pileup
+int Pileup::plp_destruct(void *data, const bam1_t *b, bam_pileup_cd *cd){
+	Pileup *p = (Pileup*)data;
+	p->readdata.put((Readdata*)cd->p);
+	cd->p = nullptr;
+	return 0;
+}
+
+static bool valid_ref(char ref_char){
+	return std::find(Genotype::alleles.begin(), Genotype::alleles.end(), ref_char) != Genotype::alleles.end();
+}
+
+//per-read values come from the Readdata attached to each read; only the base and quality are read per site
+static void read_bases(const bam_pileup1_t *pileup, int cov, const Readfilter &filter, std::vector<char> &alleles, std::vector<char> &qual, std::vector<rgid_t> &readgroups){
+	for (int i = 0; i < cov; ++i){
+		if (pileup[i].is_del || pileup[i].is_refskip){
+			continue;
+		}
+		bam1_t* alignment = pileup[i].b;
+		int qpos = pileup[i].qpos;
+		uint8_t q = bam_get_qual(alignment)[qpos];
+		const Readdata *r = (const Readdata*)pileup[i].cd.p;
+		if (q < filter.min_baseq){
+			continue;
+		}
+		if (q == 0 && filter.dedup_overlaps && r->quals[qpos] != 0){
+			continue; //the overlap pass zeroed this copy of a base its mate also covers
+		}
+		uint8_t* seq = bam_get_seq(alignment);
+		int baseint = bam_seqi(seq,qpos);
+		alleles.push_back(seq_nt16_str[baseint]);
+		qual.push_back(q);
+		readgroups.push_back(r->readgroup);
+	}
 }
 
-//possible optimization: store sequence strings in a hash w/ alignment, throw out of hash once no longer in pileup
 int Pileup::next(){
 	if((pileup = bam_plp_auto(iter, &tid, &pos, &cov)) != nullptr){ //successfully pile up new position
-		alleles.clear(); qual.clear(); names.clear(); readgroups.clear(); counts.clear();
-		alleles.reserve(cov); qual.reserve(cov); names.reserve(cov); readgroups.reserve(cov);
+		alleles.clear(); qual.clear(); readgroups.clear(); counts.fill(0);
+		alleles.reserve(cov); qual.reserve(cov); readgroups.reserve(cov);
+		if (!reader.in_region(tid, pos)){
+			return -1; //position piled up from a read overlapping a region, but outside of it
+		}
 
-		std::string refstr = ref.get_ref(get_chr_name(tid));
-		if (pos < 0 || pos >= refstr.size()){
+		if (tid != chr_tid){
+			chr_tid = tid;
+			chr_name = get_chr_name(tid);
+		}
+		ref_char = ref.get_base(chr_name, pos);
+		if (ref_char == '\0'){
 			return -1; //position piled up, but not desireable site
 		}
-		ref_char = ref.get_ref(get_chr_name(tid))[pos];
-		if (std::find(Genotype::alleles.begin(), Genotype::alleles.end(), ref_char) == Genotype::alleles.end()){
+		if (!valid_ref(ref_char)){
 			return -1; //position piled up, but ref is an invalid base
 		}
 
-		for (int i = 0; i < cov; ++i){
-			bam1_t* alignment = pileup[i].b;
-			uint8_t* seq = bam_get_seq(alignment);
-			int qpos = pileup[i].qpos;
-			int baseint = bam_seqi(seq,qpos);
-			char allele = seq_nt16_str[baseint];
-			std::string name(bam_get_qname(alignment));
-			alleles.push_back(allele);
-			++counts[allele];
-			qual.push_back(bam_get_qual(alignment)[qpos]);
-			names.push_back(name);
-			readgroups.push_back(bam_aux2Z(bam_aux_get(alignment, "RG")));
-			ref_char = ref.get_ref(get_chr_name(tid))[pos];
+		read_bases(pileup, cov, filter, alleles, qual, readgroups);
+		for (char allele : alleles){
+			int a = Genotype::allele_index(allele);
+			if (a >= 0){
+				++counts[a];
+			}
 		}
 		return 1;
 	} else {
@@ -83,3 +203,175 @@ std::map<std::string,int> Pileup::get_name_map(){
 	return reader.get_name_map();
 }
 
+const std::vector<std::string> &Pileup::get_readgroups(){
+	return reader.get_readgroups();
+}
+
+Pileupsample::Pileupsample(std::string samfile, const Readfilter *filter) : reader(samfile), filter(filter), readdata() {
+}
+
+Pileupsample::Pileupsample(std::string samfile, std::string region, const Readfilter *filter) : reader(samfile, region), filter(filter), readdata() {
+}
+
+MultiPileup::MultiPileup(const std::vector<std::string> &samfiles, std::string reffile) : samples(), ref(reffile), tid(), pos(), covs(), pileups(), iter(nullptr), chr_tid(-1), chr_name(), filter(), ref_char() {
+	init_samples(samfiles, reffile, "");
+	init_iter();
+}
+
+MultiPileup::MultiPileup(const std::vector<std::string> &samfiles, std::string reffile, std::string region) : samples(), ref(reffile), tid(), pos(), covs(), pileups(), iter(nullptr), chr_tid(-1), chr_name(), filter(), ref_char() {
+	init_samples(samfiles, reffile, region);
+	init_iter();
+}
+
+MultiPileup::~MultiPileup(){
+	if (iter != nullptr){
+		bam_mplp_destroy(iter);
+	}
+}
+
+//bam_mplp_auto hands back one tid for every file, so they all have to name the same sequences in the same order
+void MultiPileup::init_samples(const std::vector<std::string> &samfiles, std::string reffile, std::string region){
+	if (samfiles.empty()){
+		throw std::invalid_argument("MultiPileup needs at least one alignment file");
+	}
+	for (const std::string &samfile : samfiles){
+		if (region.empty()){
+			samples.emplace_back(new Pileupsample(samfile, &filter));
+		}
+		else{
+			samples.emplace_back(new Pileupsample(samfile, region, &filter));
+		}
+		SamReader &reader = samples.back()->reader;
+		reader.set_reference(reffile);
+		SamReader &first = samples.front()->reader;
+		if (reader.num_refs() != first.num_refs()){
+			throw std::runtime_error(samfile + " and " + samfiles[0] + " have different reference sequences");
+		}
+		for (int i = 0; i < reader.num_refs(); ++i){
+			if (reader.get_ref_name(i) != first.get_ref_name(i)){
+				throw std::runtime_error(samfile + " and " + samfiles[0] + " have different reference sequences");
+			}
+		}
+	}
+	size_t n = samples.size();
+	covs.assign(n, 0);
+	pileups.assign(n, nullptr);
+	alleles.assign(n, std::vector<char>());
+	qual.assign(n, std::vector<char>());
+	readgroups.assign(n, std::vector<rgid_t>());
+	counts.assign(n, std::array<int,Genotype::numalleles>());
+}
+
+//(re)build the pileup for the current filter, as Pileup::init_iter does for each file
+void MultiPileup::init_iter(){
+	int fields = SamReader::pileup_fields;
+	if (filter.dedup_overlaps){
+		fields |= SamReader::mate_fields;
+	}
+	std::vector<void*> data;
+	for (std::unique_ptr<Pileupsample> &sample : samples){
+		sample->reader.set_required_fields(fields);
+		data.push_back(sample.get());
+	}
+	if (iter != nullptr){
+		bam_mplp_destroy(iter);
+	}
+	iter = bam_mplp_init(data.size(), &MultiPileup::plp_get_read, data.data());
+	bam_mplp_constructor(iter, &MultiPileup::plp_construct);
+	bam_mplp_destructor(iter, &MultiPileup::plp_destruct);
+	bam_mplp_set_maxcnt(iter, filter.max_depth);
+	if (filter.dedup_overlaps){
+		bam_mplp_init_overlaps(iter);
+	}
+}
+
+void MultiPileup::set_filter(const Readfilter &f){
+	filter = f;
+	init_iter();
+}
+
+const Readfilter &MultiPileup::get_filter(){
+	return filter;
+}
+
+//data is the Pileupsample for the file being read
+int MultiPileup::plp_get_read(void *data, bam1_t *b){
+	Pileupsample *s = (Pileupsample*)data;
+	int r;
+	while ((r = s->reader.next(b)) >= 0 && !s->filter->keep(b)){
+	}
+	return r;
+}
+
+int MultiPileup::plp_construct(void *data, const bam1_t *b, bam_pileup_cd *cd){
+	Pileupsample *s = (Pileupsample*)data;
+	cd->p = fill_readdata(s->readdata.get(), s->reader, b, *s->filter);
+	return 0;
+}
+
+int MultiPileup::plp_destruct(void *data, const bam1_t *b, bam_pileup_cd *cd){
+	Pileupsample *s = (Pileupsample*)data;
+	s->readdata.put((Readdata*)cd->p);
+	cd->p = nullptr;
+	return 0;
+}
+
+//one position for every sample; samples without reads here get empty vectors and zero counts
+int MultiPileup::next(){
+	int r = bam_mplp_auto(iter, &tid, &pos, covs.data(), pileups.data());
+	if (r < 0){
+		throw std::runtime_error("error piling up alignments");
+	}
+	if (r == 0){
+		return 0;
+	}
+	for (size_t i = 0; i < samples.size(); ++i){
+		alleles[i].clear(); qual[i].clear(); readgroups[i].clear();
+		counts[i].fill(0);
+	}
+	if (!samples.front()->reader.in_region(tid, pos)){
+		return -1; //position piled up from a read overlapping a region, but outside of it
+	}
+	if (tid != chr_tid){
+		chr_tid = tid;
+		chr_name = get_chr_name(tid);
+	}
+	ref_char = ref.get_base(chr_name, pos);
+	if (ref_char == '\0' || !valid_ref(ref_char)){
+		return -1; //off the end of the reference or an invalid base
+	}
+	for (size_t i = 0; i < samples.size(); ++i){
+		read_bases(pileups[i], covs[i], filter, alleles[i], qual[i], readgroups[i]);
+		for (char allele : alleles[i]){
+			int a = Genotype::allele_index(allele);
+			if (a >= 0){
+				++counts[i][a];
+			}
+		}
+	}
+	return 1;
+}
+
+size_t MultiPileup::num_samples(){
+	return samples.size();
+}
+
+int MultiPileup::get_tid(){
+	return tid;
+}
+
+int MultiPileup::get_pos(){
+	return pos;
+}
+
+std::string MultiPileup::get_chr_name(int tid){
+	return samples.front()->reader.get_ref_name(tid);
+}
+
+std::map<std::string,int> MultiPileup::get_name_map(){
+	return samples.front()->reader.get_name_map();
+}
+
+const std::vector<std::string> &MultiPileup::get_readgroups(size_t sample){
+	return samples.at(sample)->reader.get_readgroups();
+}
@@ -3,10 +3,41 @@
 
 #include "samio.h"
 #include "reftype.h"
+#include "genotype.h"
 #include <htslib/sam.h>
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <array>
 
+//per-read values, computed once when the read enters the pileup instead of at every site it covers
+struct Readdata{
+	rgid_t readgroup;
+	std::vector<uint8_t> quals; //base qualities before overlapping mates are deduplicated; only kept when they are
+};
+
+//owns every Readdata handed out to one pileup. reads that leave the pileup put theirs back for the next read.
+struct Readdata_pool{
+	std::vector<std::unique_ptr<Readdata>> owned;
+	std::vector<Readdata*> free;
+	Readdata *get();
+	void put(Readdata *r);
+};
+
+//which reads and bases make it into the pileup. reads are checked as they are read,
+//so rejected reads never enter the pileup buffer.
+struct Readfilter{
+	uint16_t flag_mask; //reads with any of these flags are dropped
+	int min_mapq;
+	int min_baseq; //lower quality bases are skipped
+	int max_depth; //most reads piled up at one position
+	bool dedup_overlaps; //count a base covered by both mates of a pair once
+	Readfilter(); //unmapped, secondary, QC fail and duplicate reads dropped; depth 8000; overlaps deduplicated
+	bool keep(const bam1_t *b) const;
+};
+
+//the pileup's callbacks are handed this, so a Pileup can't be copied
 class Pileup{
 protected:
 	SamReader reader;
@@ -16,16 +47,25 @@ protected:
 	int cov;
 	const bam_pileup1_t *pileup;
 	bam_plp_t iter;
+	int chr_tid; //tid of chr_name, so the name is only looked up when tid changes
+	std::string chr_name;
+	Readdata_pool readdata;
+	Readfilter filter;
+	void init_reader(std::string reffile);
+	void init_iter();
+	static int plp_construct(void *data, const bam1_t *b, bam_pileup_cd *cd);
+	static int plp_destruct(void *data, const bam1_t *b, bam_pileup_cd *cd);
 public:
-	Pileup(std::string samfile, std::string reffile);
-	Pileup(std::string samfile, std::string reffile, std::string region);
+	Pileup(std::string samfile, std::string reffile); //samfile may be SAM, BAM or CRAM
+	Pileup(std::string samfile, std::string reffile, std::string region); //region is a BED file or comma separated list; other positions are skipped
 	Pileup();
+	Pileup(const Pileup&) = delete;
+	Pileup &operator=(const Pileup&) = delete;
 	~Pileup();
 	std::vector<char> alleles;
 	std::vector<char> qual;
-	std::vector<std::string> names;
-	std::vector<std::string> readgroups;
-	std::map<char,int> counts;
+	std::vector<rgid_t> readgroups; //ids into get_readgroups()
+	std::array<int,Genotype::numalleles> counts; //counts[i] = number of Genotype::alleles[i] seen; an allelecounts_t
 	char ref_char;
 	static int plp_get_read(void *data, bam1_t *b);
 	int next();
@@ -33,8 +73,62 @@ public:
 	int get_pos();
 	int get_ref_tid(std::string name);
 	std::map<std::string,int> get_name_map();
+	const std::vector<std::string> &get_readgroups();
 	std::string get_chr_name(int tid);
+	void set_filter(const Readfilter &f); //call before next()
+	const Readfilter &get_filter();
+	void set_region(interval_t r); //start over at r, reusing the open file, index and reference. throws.
 };
 
+//one input file of a MultiPileup; the pileup callbacks for that file are handed this
+struct Pileupsample{
+	SamReader reader;
+	const Readfilter *filter;
+	Readdata_pool readdata;
+	Pileupsample(std::string samfile, const Readfilter *filter);
+	Pileupsample(std::string samfile, std::string region, const Readfilter *filter);
+};
+
+//piles up several alignment files in lockstep, one bam_mplp_auto call per position, so the
+//reference is looked up and the position visited once for the whole cohort.
+//the files must be sorted against the same reference sequences; tids and names come from the first.
+class MultiPileup{
+protected:
+	std::vector<std::unique_ptr<Pileupsample>> samples;
+	Reftype ref;
+	int tid;
+	int pos;
+	std::vector<int> covs; //per sample
+	std::vector<const bam_pileup1_t*> pileups;
+	bam_mplp_t iter;
+	int chr_tid;
+	std::string chr_name;
+	Readfilter filter;
+	void init_samples(const std::vector<std::string> &samfiles, std::string reffile, std::string region);
+	void init_iter();
+	static int plp_get_read(void *data, bam1_t *b);
+	static int plp_construct(void *data, const bam1_t *b, bam_pileup_cd *cd);
+	static int plp_destruct(void *data, const bam1_t *b, bam_pileup_cd *cd);
+public:
+	MultiPileup(const std::vector<std::string> &samfiles, std::string reffile); //throws if the files don't share reference sequences
+	MultiPileup(const std::vector<std::string> &samfiles, std::string reffile, std::string region); //region as for Pileup; every file needs an index
+	MultiPileup(const MultiPileup&) = delete;
+	MultiPileup &operator=(const MultiPileup&) = delete;
+	~MultiPileup();
+	std::vector<std::vector<char>> alleles; //alleles[sample]; empty if the sample has no usable bases here
+	std::vector<std::vector<char>> qual;
+	std::vector<std::vector<rgid_t>> readgroups; //ids into get_readgroups(sample)
+	std::vector<std::array<int,Genotype::numalleles>> counts; //counts[sample][i] = number of Genotype::alleles[i] seen; an allelecounts_t
+	char ref_char;
+	int next(); //as Pileup::next. throws on read errors.
+	size_t num_samples();
+	int get_tid();
+	int get_pos();
+	std::string get_chr_name(int tid);
+	std::map<std::string,int> get_name_map();
+	const std::vector<std::string> &get_readgroups(size_t sample);
+	void set_filter(const Readfilter &f); //call before next()
+	const Readfilter &get_filter();
+};
 
 #endif
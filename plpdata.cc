@@ -1,71 +1,662 @@
 #include "plpdata.h"
 #include <iostream>
 #include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "parallel.h"
 
-Pileupdata::Pileupdata(std::string filename, std::string refname, std::string region) : plp(filename, refname, region), data() {
-	populate_data();
+Pileupcolumns::Pileupcolumns() : bases(), quals(), readgroups(), offsets(1,0), tids(), positions(), refs(), counts() {
 }
 
-Pileupdata::Pileupdata(std::string filename, std::string refname) : plp(filename, refname), data() {
-	populate_data();
+size_t Pileupcolumns::size() const{
+	return refs.size();
 }
 
-Pileupdata::Pileupdata(Pileup p) : plp(p), data() {
-	populate_data();
+size_t Pileupcolumns::num_bases() const{
+	return bases.size();
 }
 
-Pileupdata::Pileupdata(std::vector<char> x, char ref, std::vector<char> quals) : plp(), data(){
+Siteview Pileupcolumns::site(size_t i) const{
+	return view().site(i);
+}
+
+Columnview Pileupcolumns::view() const{
+	Columnview v;
+	v.nsites = size();
+	v.nbases = num_bases();
+	v.offsets = offsets.data();
+	v.tids = tids.data();
+	v.positions = positions.data();
+	v.refs = refs.data();
+	v.counts = counts.data();
+	v.bases = bases.data();
+	v.quals = quals.data();
+	v.readgroups = readgroups.data();
+	return v;
+}
+
+Siteview Columnview::site(size_t i) const{
+	size_t start = offsets[i];
+	Siteview s;
+	s.tid = tids[i];
+	s.pos = positions[i];
+	s.ref = refs[i];
+	s.depth = offsets[i+1] - start;
+	s.bases = bases + start;
+	s.quals = quals + start;
+	s.readgroups = readgroups + start;
+	s.counts = &counts[i];
+	return s;
+}
+
+//sites are stored in genomic order so we can binary search
+size_t Columnview::find(int tid, int pos) const{
+	size_t lo = 0;
+	size_t hi = nsites;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if (tids[mid] < tid || (tids[mid] == tid && positions[mid] < pos)){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	if (lo == nsites || tids[lo] != tid || positions[lo] != pos){
+		return nsites;
+	}
+	return lo;
+}
+
+void Pileupcolumns::push_back(int tid, int pos, char ref, const std::vector<char> &x, const std::vector<char> &q, const std::vector<rgid_t> &rgs){
+	bases.insert(bases.end(), x.begin(), x.end());
+	quals.insert(quals.end(), q.begin(), q.end());
+	readgroups.insert(readgroups.end(), rgs.begin(), rgs.end());
+	offsets.push_back(bases.size());
+	tids.push_back(tid);
+	positions.push_back(pos);
+	refs.push_back(ref);
+	counts.push_back(Pileupdata::count_alleles(x));
+}
+
+void Pileupcolumns::append(const Pileupcolumns &other){
+	size_t shift = bases.size();
+	bases.insert(bases.end(), other.bases.begin(), other.bases.end());
+	quals.insert(quals.end(), other.quals.begin(), other.quals.end());
+	readgroups.insert(readgroups.end(), other.readgroups.begin(), other.readgroups.end());
+	for (size_t i = 1; i < other.offsets.size(); ++i){
+		offsets.push_back(other.offsets[i] + shift);
+	}
+	tids.insert(tids.end(), other.tids.begin(), other.tids.end());
+	positions.insert(positions.end(), other.positions.begin(), other.positions.end());
+	refs.insert(refs.end(), other.refs.begin(), other.refs.end());
+	counts.insert(counts.end(), other.counts.begin(), other.counts.end());
+}
+
+void Pileupcolumns::clear(){
+	bases.clear(); quals.clear(); readgroups.clear();
+	offsets.resize(1);
+	tids.clear(); positions.clear(); refs.clear(); counts.clear();
+}
+
+Pileupdata::Pileupdata(streaming_tag, std::string filename, std::string refname, std::string region) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(false), streaming(true), filename(filename), refname(refname), region(region) {
+}
+
+Pileupdata Pileupdata::open_streaming(std::string filename, std::string refname, std::string region){
+	return Pileupdata(streaming_tag(), filename, refname, region);
+}
+
+Pileupdata::Pileupdata(std::string filename, std::string refname, std::string region) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false), filename(filename), refname(refname), region(region) {
+	Pileup p(filename, refname, region);
+	populate_data(p);
+}
+
+Pileupdata::Pileupdata(std::string filename, std::string refname) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false), filename(filename), refname(refname), region() {
+	Pileup p(filename, refname);
+	populate_data(p);
+}
+
+Pileupdata::Pileupdata(std::string filename, std::string refname, int threads, int window) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false), filename(filename), refname(refname), region() {
+	if (window <= 0){
+		throw std::invalid_argument("shard window must be positive, got " + std::to_string(window));
+	}
+	if (threads <= 1 || !SamReader::has_index(filename)){
+		Pileup p(filename, refname);
+		populate_data(p);
+	}
+	else{
+		populate_sharded(threads, window);
+	}
+}
+
+Pileupdata::Pileupdata(Pileup &p) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false) {
+	populate_data(p);
+}
+
+Pileupdata::Pileupdata(const std::vector<std::string> &filenames, std::string refname) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false), filename(), refname(refname), region() {
+	MultiPileup p(filenames, refname);
+	populate_data(p);
+}
+
+Pileupdata::Pileupdata(const std::vector<std::string> &filenames, std::string refname, std::string region) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false), filename(), refname(refname), region(region) {
+	MultiPileup p(filenames, refname, region);
+	populate_data(p);
+}
+
+Pileupdata::Pileupdata(std::vector<char> x, char ref, std::vector<char> quals) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false) {
 	populate_data(x,ref,quals);
 }
 
 Pileupdata::Pileupdata(std::vector<char> x) : Pileupdata(x, x[0], x) {
 }
 
-//I'll need to think of something better; this will break if the pileup isn't completely contiguous (ie multiple ranges)
-void Pileupdata::populate_data(){
-	std::map<std::string,int> chrs = plp.get_name_map();
+Pileupdata::Pileupdata(std::string cachefile) : data(), mapping(), mapped(), name_map(), patterns(), patterns_loaded(true), streaming(false) {
+	map_cache(cachefile);
+}
+
+//site readgroup ids come straight from the reader, so we take its dictionary afterwards
+void Pileupdata::populate_data(Pileup &p){
 	int val;
-	while((val = plp.next()) != 0){
+	while((val = p.next()) != 0){
 		if (val == 1){
-			int tid = plp.get_tid();
-			char ref_char = plp.ref_char;		
-			data.resize(tid + 1);
-			data[tid].push_back(std::make_tuple(plp.alleles,plp.counts,plp.qual,ref_char,plp.readgroups));
-			++ref_counts[ref_char];
+			add_site(data, p);
+			tally_site(data.size() - 1);
+		}
+	}
+	load_readgroups(p.get_readgroups());
+	name_map = p.get_name_map();
+}
+
+//each sample is a separate draw of genotypes at a site, so each gets its own pattern.
+//per-site columns aren't kept; they would need a sample dimension.
+void Pileupdata::populate_data(MultiPileup &p){
+	int val;
+	while((val = p.next()) != 0){
+		if (val != 1){
+			continue;
+		}
+		for (size_t i = 0; i < p.num_samples(); ++i){
+			if (!p.alleles[i].empty()){
+				++ref_counts[p.ref_char];
+				add_pattern(p.counts[i], p.ref_char);
+			}
 		}
 	}
+	for (size_t i = 0; i < p.num_samples(); ++i){
+		for (const std::string &rg : p.get_readgroups(i)){
+			readgroup_id(rg);
+		}
+	}
+	name_map = p.get_name_map();
+}
+
+//split the genome into windows and pile each one up through its own index query on a worker thread.
+//every worker has its own SamReader and Reftype. shards are appended in genomic order, so the
+//result is the same as a single-threaded pass.
+void Pileupdata::populate_sharded(int threads, int window){
+	std::vector<interval_t> shards; //0-based, half open
+	SamReader reader(filename);
+	for (int tid = 0; tid < reader.num_refs(); ++tid){
+		int len = reader.get_ref_len(tid);
+		for (int beg = 0; beg < len; beg += window){
+			shards.push_back(std::make_tuple(tid, beg, std::min(beg + window, len)));
+		}
+	}
+
+	load_readgroups(reader.get_readgroups());
+	name_map = reader.get_name_map();
+	std::vector<Pileupcolumns> columns(shards.size());
+	std::vector<std::vector<std::string>> shard_readgroups(shards.size()); //a shard only differs from the header if reads have RGs it doesn't declare
+	std::vector<std::unique_ptr<Pileup>> pileups(threads); //one open file, index and reference per worker, re-queried for each shard
+	meep_parallel::parallel_for(shards.size(), threads, [&](size_t i, int thread){
+		int tid = std::get<0>(shards[i]);
+		int beg = std::get<1>(shards[i]);
+		int end = std::get<2>(shards[i]);
+		if (pileups[thread] == nullptr){
+			pileups[thread].reset(new Pileup(filename, refname));
+		}
+		Pileup &p = *pileups[thread];
+		p.set_region(shards[i]);
+		int val;
+		while((val = p.next()) != 0){
+			if (p.get_tid() != tid || p.get_pos() >= end){
+				break;
+			}
+			//reads starting before beg pile up there too; those positions belong to the previous shard
+			if (val == 1 && p.get_pos() >= beg){
+				columns[i].push_back(tid, p.get_pos(), p.ref_char, p.alleles, p.qual, p.readgroups);
+			}
+		}
+		shard_readgroups[i] = p.get_readgroups(); //ids only grow as a worker's reader sees new RGs, so the latest list covers this shard
+	});
+
+	for (size_t i = 0; i < shards.size(); ++i){
+		std::vector<rgid_t> remap;
+		for (const std::string &rg : shard_readgroups[i]){
+			remap.push_back(readgroup_id(rg));
+		}
+		for (rgid_t &id : columns[i].readgroups){
+			id = remap[id];
+		}
+		size_t first = data.size();
+		data.append(columns[i]);
+		columns[i] = Pileupcolumns(); //free the shard as soon as it is merged
+		for (size_t j = first; j < data.size(); ++j){
+			tally_site(j);
+		}
+	}
+}
+
+void Pileupdata::tally_site(size_t i){
+	++ref_counts[data.refs[i]];
+	add_pattern(data.counts[i], data.refs[i]);
 }
 
 void Pileupdata::populate_data(std::vector<char> x, char ref, std::vector<char> quals){
-	std::map<char,int> counts = {{'A',0},{'T',0},{'G',0},{'C',0}};
-	std::vector<std::string> rgs(x.size(),"RG0");
-	for (char i : x){
-		++counts[i];
-	}
-	data.resize(1);
-	std::vector<pileuptuple_t> v(1,std::make_tuple(x,counts,quals,ref,rgs));
-	data.push_back(v);
+	std::vector<rgid_t> rgs(x.size(),readgroup_id("RG0"));
+	data.push_back(0, 0, ref, x, quals, rgs);
 	++ref_counts[ref];
+	add_pattern(data.counts.back(), ref);
+}
+
+void Pileupdata::add_site(Pileupcolumns &c, Pileup &p){
+	c.push_back(p.get_tid(), p.get_pos(), p.ref_char, p.alleles, p.qual, p.readgroups);
 }
 
+void Pileupdata::load_readgroups(const std::vector<std::string> &names){
+	readgroup_names = names;
+	readgroup_ids.clear();
+	for (size_t i = 0; i < names.size(); ++i){
+		readgroup_ids[names[i]] = i;
+	}
+}
+
+rgid_t Pileupdata::readgroup_id(const std::string &rg){
+	auto it = readgroup_ids.find(rg);
+	if (it != readgroup_ids.end()){
+		return it->second;
+	}
+	rgid_t id = readgroup_names.size();
+	readgroup_names.push_back(rg);
+	readgroup_ids[rg] = id;
+	return id;
+}
+
+void Pileupdata::add_pattern(const allelecounts_t &x, char ref){
+	++patterns[std::make_tuple(ref, x)];
+}
+
+allelecounts_t Pileupdata::count_alleles(const std::vector<char> &x){
+	allelecounts_t counts = {};
+	for (char b : x){
+		int i = Genotype::allele_index(b);
+		if (i >= 0){
+			++counts[i];
+		}
+	}
+	return counts;
+}
+
+const patterncounts_t &Pileupdata::get_patterns(){
+	if (!patterns_loaded){
+		for_each_site([this](const Siteview &site){
+			++ref_counts[site.ref];
+			add_pattern(*site.counts, site.ref);
+		});
+		patterns_loaded = true;
+	}
+	return patterns;
+}
+
+//patterns only change while the data is being built, so a size mismatch means the list is stale
+const patternlist_t &Pileupdata::get_pattern_list(){
+	const patterncounts_t &p = get_patterns();
+	if (pattern_list.size() != p.size()){
+		pattern_list.assign(p.begin(), p.end());
+	}
+	return pattern_list;
+}
+
+//every pattern has one count per name in get_readgroups(); an id past those is corrupt data, not a new readgroup
+const rgpatternlist_t &Pileupdata::get_rg_pattern_list(){
+	if (rg_pattern_list.empty()){
+		std::map<rgpattern_t,int> counted;
+		size_t readgroups = get_readgroups().size();
+		rgcounts_t x;
+		for_each_site([&](const Siteview &site){
+			x.assign(readgroups, allelecounts_t());
+			for (size_t i = 0; i < site.depth; ++i){
+				int a = Genotype::allele_index(site.bases[i]);
+				if (a < 0){
+					continue;
+				}
+				rgid_t rg = site.readgroups[i];
+				if (rg >= readgroups){
+					throw std::runtime_error("readgroup id " + std::to_string(rg) + " has no name; only " + std::to_string(readgroups) + " readgroups are known");
+				}
+				++x[rg][a];
+			}
+			++counted[std::make_tuple(site.ref, x)];
+		});
+		rg_pattern_list.assign(counted.begin(), counted.end());
+	}
+	return rg_pattern_list;
+}
+
+size_t Pileupdata::num_sites(){
+	return columns().nsites;
+}
+
+Siteview Pileupdata::site(size_t i){
+	return columns().site(i);
+}
+
+Siteview Pileupdata::site_at(int tid, int pos){
+	Columnview c = columns();
+	size_t i = c.find(tid, pos);
+	if (i == c.nsites){
+		throw std::out_of_range("no pileup at tid " + std::to_string(tid) + " pos " + std::to_string(pos));
+	}
+	return c.site(i);
+}
+
+Columnview Pileupdata::columns(){
+	return (mapping != nullptr ? mapped : data.view());
+}
 
 std::vector<char> Pileupdata::bases_at(int tid, int pos){
-	return std::get<0>(data[tid][pos]);
+	Siteview s = site_at(tid,pos);
+	return std::vector<char>(s.bases, s.bases + s.depth);
 }
 
 int Pileupdata::depth_at(int tid, int pos){
-	return Pileupdata::bases_at(tid,pos).size();
+	return site_at(tid,pos).depth;
 }
 
 int Pileupdata::num_base(int tid, int pos, char base){
-	return std::get<1>(data[tid][pos])[base];
+	int i = Genotype::allele_index(base);
+	return (i < 0 ? 0 : (*site_at(tid,pos).counts)[i]);
 }
 
 std::map<std::string,int> Pileupdata::get_name_map(){
-	return plp.get_name_map();
+	if (streaming){
+		return SamReader(filename).get_name_map();
+	}
+	return name_map;
+}
+
+//streaming mode tallies ref_counts in the same pass that builds the patterns
+std::map<char,int> Pileupdata::get_ref_counts(){
+	get_patterns();
+	return ref_counts;
+}
+
+const std::vector<std::string> &Pileupdata::get_readgroups(){
+	return readgroup_names;
 }
 
-pileupdata_t Pileupdata::get_data(){
-	return data;
+Columnview Pileupdata::get_data(){
+	return columns();
 }
 
+bool Pileupdata::is_streaming(){
+	return streaming;
+}
+
+//a fresh Pileup is opened for every pass in streaming mode
+void Pileupdata::for_each_site(site_f f){
+	if (streaming){
+		if (region.empty()){
+			Pileup p(filename, refname);
+			stream_sites(p, f);
+		}
+		else{
+			Pileup p(filename, refname, region);
+			stream_sites(p, f);
+		}
+	}
+	else{
+		Columnview c = columns();
+		for (size_t i = 0; i < c.nsites; ++i){
+			f(c.site(i));
+		}
+	}
+}
+
+//a single-site buffer is reused so its storage is only allocated once
+void Pileupdata::stream_sites(Pileup &p, site_f f){
+	Pileupcolumns buffer;
+	int val;
+	while((val = p.next()) != 0){
+		if (val == 1){
+			buffer.clear();
+			add_site(buffer, p);
+			f(buffer.site(0));
+		}
+	}
+	load_readgroups(p.get_readgroups());
+}
+
+//cache file layout. everything is in native byte order, so a cache is only portable between machines with the same endianness.
+//	char magic[8]; uint32 version; uint32 flags;
+//	uint64 nsites, nbases, npatterns, nreadgroups, nnames;
+//	nreadgroups x {uint32 len; char name[len]}
+//	nnames x {uint32 len; char name[len]; int32 tid}
+//then each of these arrays, starting on an 8 byte boundary:
+//	uint64 offsets[nsites + 1]; int32 tids[nsites]; int32 positions[nsites]; char refs[nsites];
+//	int32 counts[nsites][4]; char bases[nbases]; char quals[nbases]; uint16 readgroups[nbases];
+//	npatterns x {int32 ref; int32 counts[4]; int32 multiplicity}
+//a patterns only cache has nsites = nbases = 0 and cache_patterns_only set in flags.
+namespace {
+	const char cache_magic[8] = {'M','E','E','P','P','L','P','\0'};
+	const uint32_t cache_patterns_only = 1; //flags bit; no other bits are defined
+
+	struct Cacheheader{
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint64_t nsites;
+		uint64_t nbases;
+		uint64_t npatterns;
+		uint64_t nreadgroups;
+		uint64_t nnames;
+	};
+
+	struct Cachepattern{
+		int32_t ref;
+		int32_t counts[Genotype::numalleles];
+		int32_t multiplicity;
+	};
+
+	void write_bytes(std::ofstream &out, size_t &pos, const void *p, size_t n){
+		out.write((const char*)p, n);
+		pos += n;
+	}
+
+	void write_padding(std::ofstream &out, size_t &pos){
+		static const char zeros[8] = {};
+		write_bytes(out, pos, zeros, (8 - pos % 8) % 8);
+	}
+
+	void write_string(std::ofstream &out, size_t &pos, const std::string &s){
+		uint32_t len = s.size();
+		write_bytes(out, pos, &len, sizeof(len));
+		write_bytes(out, pos, s.data(), len);
+	}
+
+	//bounds checked cursor over the mapped file
+	class Cachereader{
+	public:
+		const char *start;
+		size_t size;
+		size_t pos;
+		Cachereader(const char *start, size_t size) : start(start), size(size), pos(0) {}
+		const char *take(size_t n){
+			if (n > size - pos){
+				throw std::runtime_error("truncated pileup cache");
+			}
+			const char *p = start + pos;
+			pos += n;
+			return p;
+		}
+		const char *take_aligned(size_t n){
+			pos = std::min(size, pos + (8 - pos % 8) % 8);
+			return take(n);
+		}
+		std::string take_string(){
+			uint32_t len;
+			std::memcpy(&len, take(sizeof(len)), sizeof(len));
+			return std::string(take(len), len);
+		}
+		//n items of at least item_size bytes each must fit in the file; checked before n is multiplied into a byte count
+		void check_count(uint64_t n, size_t item_size){
+			if (n > size / item_size){
+				throw std::runtime_error("corrupt pileup cache: " + std::to_string(n) + " items can't fit in " + std::to_string(size) + " bytes");
+			}
+		}
+	};
+}
+
+//streaming data has no sites to write, but the patterns can still be saved
+void Pileupdata::write_cache(std::string cachefile, bool patterns_only){
+	if (streaming && !patterns_only){
+		throw std::invalid_argument("a streaming Pileupdata can only write a patterns only cache");
+	}
+	Pileupcolumns empty;
+	Columnview c = (patterns_only ? empty.view() : columns());
+	const patterncounts_t &pats = get_patterns();
+	std::map<std::string,int> names = get_name_map();
+
+	std::ofstream out(cachefile, std::ios::binary | std::ios::trunc);
+	if (!out){
+		throw std::runtime_error("error opening pileup cache " + cachefile + " for writing");
+	}
+	size_t pos = 0;
+	Cacheheader h = {};
+	std::memcpy(h.magic, cache_magic, sizeof(cache_magic));
+	h.version = cache_version;
+	h.flags = (patterns_only ? cache_patterns_only : 0);
+	h.nsites = c.nsites;
+	h.nbases = c.nbases;
+	h.npatterns = pats.size();
+	h.nreadgroups = readgroup_names.size();
+	h.nnames = names.size();
+	write_bytes(out, pos, &h, sizeof(h));
+	for (const std::string &rg : readgroup_names){
+		write_string(out, pos, rg);
+	}
+	for (const auto &n : names){
+		int32_t tid = n.second;
+		write_string(out, pos, n.first);
+		write_bytes(out, pos, &tid, sizeof(tid));
+	}
+	write_padding(out, pos); write_bytes(out, pos, c.offsets, sizeof(uint64_t) * (c.nsites + 1));
+	write_padding(out, pos); write_bytes(out, pos, c.tids, sizeof(int32_t) * c.nsites);
+	write_padding(out, pos); write_bytes(out, pos, c.positions, sizeof(int32_t) * c.nsites);
+	write_padding(out, pos); write_bytes(out, pos, c.refs, c.nsites);
+	write_padding(out, pos); write_bytes(out, pos, c.counts, sizeof(allelecounts_t) * c.nsites);
+	write_padding(out, pos); write_bytes(out, pos, c.bases, c.nbases);
+	write_padding(out, pos); write_bytes(out, pos, c.quals, c.nbases);
+	write_padding(out, pos); write_bytes(out, pos, c.readgroups, sizeof(rgid_t) * c.nbases);
+	write_padding(out, pos);
+	for (const auto &p : pats){
+		Cachepattern cp;
+		cp.ref = std::get<0>(p.first);
+		for (size_t i = 0; i < Genotype::numalleles; ++i){
+			cp.counts[i] = std::get<1>(p.first)[i];
+		}
+		cp.multiplicity = p.second;
+		write_bytes(out, pos, &cp, sizeof(cp));
+	}
+	if (!out){
+		throw std::runtime_error("error writing pileup cache " + cachefile);
+	}
+}
+
+//per-site arrays are used in place; only the names and the pattern map are copied out
+void Pileupdata::map_cache(std::string cachefile){
+	int fd = open(cachefile.c_str(), O_RDONLY);
+	if (fd < 0){
+		throw std::runtime_error("error opening pileup cache " + cachefile);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Cacheheader)){
+		close(fd);
+		throw std::runtime_error("error reading pileup cache " + cachefile);
+	}
+	size_t size = st.st_size;
+	void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED){
+		throw std::runtime_error("error mapping pileup cache " + cachefile);
+	}
+	mapping = std::shared_ptr<void>(p, [size](void *p){ munmap(p, size); });
+
+	Cachereader r((const char*)p, size);
+	Cacheheader h;
+	std::memcpy(&h, r.take(sizeof(h)), sizeof(h));
+	if (std::memcmp(h.magic, cache_magic, sizeof(cache_magic)) != 0){
+		throw std::runtime_error(cachefile + " is not a pileup cache");
+	}
+	if (h.version != cache_version){
+		throw std::runtime_error("pileup cache " + cachefile + " has version " + std::to_string(h.version) + ", expected " + std::to_string(cache_version));
+	}
+	if ((h.flags & ~cache_patterns_only) != 0 || ((h.flags & cache_patterns_only) != 0 && (h.nsites != 0 || h.nbases != 0))){
+		throw std::runtime_error("corrupt pileup cache " + cachefile);
+	}
+	r.check_count(h.nreadgroups, sizeof(uint32_t));
+	r.check_count(h.nnames, sizeof(uint32_t) + sizeof(int32_t));
+	r.check_count(h.nsites, sizeof(uint64_t) + 2 * sizeof(int32_t) + 1 + sizeof(allelecounts_t));
+	r.check_count(h.nbases, 2 + sizeof(rgid_t));
+	r.check_count(h.npatterns, sizeof(Cachepattern));
+	std::vector<std::string> rgs;
+	for (uint64_t i = 0; i < h.nreadgroups; ++i){
+		rgs.push_back(r.take_string());
+	}
+	load_readgroups(rgs);
+	for (uint64_t i = 0; i < h.nnames; ++i){
+		std::string name = r.take_string();
+		int32_t tid;
+		std::memcpy(&tid, r.take(sizeof(tid)), sizeof(tid));
+		name_map[name] = tid;
+	}
+	mapped.nsites = h.nsites;
+	mapped.nbases = h.nbases;
+	mapped.offsets = (const uint64_t*)r.take_aligned(sizeof(uint64_t) * (h.nsites + 1));
+	mapped.tids = (const int32_t*)r.take_aligned(sizeof(int32_t) * h.nsites);
+	mapped.positions = (const int32_t*)r.take_aligned(sizeof(int32_t) * h.nsites);
+	mapped.refs = r.take_aligned(h.nsites);
+	mapped.counts = (const allelecounts_t*)r.take_aligned(sizeof(allelecounts_t) * h.nsites);
+	mapped.bases = r.take_aligned(h.nbases);
+	mapped.quals = r.take_aligned(h.nbases);
+	mapped.readgroups = (const rgid_t*)r.take_aligned(sizeof(rgid_t) * h.nbases);
+	//sites and readgroup lookups index with these unchecked, so check them once here
+	if (mapped.offsets[0] != 0 || mapped.offsets[h.nsites] != h.nbases){
+		throw std::runtime_error("corrupt pileup cache " + cachefile);
+	}
+	for (uint64_t i = 0; i < h.nsites; ++i){
+		if (mapped.offsets[i + 1] < mapped.offsets[i]){
+			throw std::runtime_error("corrupt pileup cache " + cachefile + ": site offsets decrease at site " + std::to_string(i));
+		}
+	}
+	for (uint64_t i = 0; i < h.nbases; ++i){
+		if (mapped.readgroups[i] >= h.nreadgroups){
+			throw std::runtime_error("corrupt pileup cache " + cachefile + ": readgroup id " + std::to_string(mapped.readgroups[i]) + " out of range");
+		}
+	}
+	const Cachepattern *pats = (const Cachepattern*)r.take_aligned(sizeof(Cachepattern) * h.npatterns);
+	for (uint64_t i = 0; i < h.npatterns; ++i){
+		allelecounts_t counts;
+		for (size_t j = 0; j < Genotype::numalleles; ++j){
+			counts[j] = pats[i].counts[j];
+		}
+		patterns[std::make_tuple((char)pats[i].ref, counts)] = pats[i].multiplicity;
+		ref_counts[(char)pats[i].ref] += pats[i].multiplicity;
+	}
+}
@@ -4,32 +4,141 @@
 #include <tuple>
 #include <vector>
 #include <map>
+#include <functional>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
 #include "pileup.h"
+#include "genotype.h"
 
-typedef std::tuple<std::vector<char>,std::map<char,int>,std::vector<char>,char,std::vector<std::string> > pileuptuple_t; //(bases, counts, qualities, readgroups)
-typedef std::vector<std::vector<pileuptuple_t> > pileupdata_t; //data[tid][pos] = (bases, counts, qualities, ref, readgroups)
+typedef std::array<int,Genotype::numalleles> allelecounts_t; //counts[i] = number of Genotype::alleles[i] seen
+typedef std::tuple<char,allelecounts_t> sitepattern_t; //(ref, counts)
+typedef std::map<sitepattern_t,int> patterncounts_t; //pattern -> number of sites with that pattern
+typedef std::vector<std::pair<sitepattern_t,int>> patternlist_t; //patterncounts_t as a vector, so it can be split into chunks
+typedef std::vector<allelecounts_t> rgcounts_t; //rgcounts_t[rg] = counts from readgroup rg, for every readgroup
+typedef std::tuple<char,rgcounts_t> rgpattern_t; //(ref, counts per readgroup)
+typedef std::vector<std::pair<rgpattern_t,int>> rgpatternlist_t; //distinct rgpattern_t with the number of sites having each
 
+//non-owning view of one site. pointers are valid until the owning storage is modified.
+struct Siteview{
+	int tid;
+	int pos;
+	char ref;
+	size_t depth;
+	const char *bases; //depth bases
+	const char *quals; //depth qualities
+	const rgid_t *readgroups; //depth readgroup ids
+	const allelecounts_t *counts;
+};
+
+typedef std::function<void(const Siteview&)> site_f; //called once per site by Pileupdata::for_each_site
+
+//non-owning pointers to columnar site data, either in a Pileupcolumns or a mapped cache file
+struct Columnview{
+	size_t nsites;
+	size_t nbases;
+	const uint64_t *offsets; //nsites + 1
+	const int32_t *tids;
+	const int32_t *positions;
+	const char *refs;
+	const allelecounts_t *counts;
+	const char *bases; //nbases
+	const char *quals;
+	const rgid_t *readgroups;
+	Siteview site(size_t i) const;
+	size_t find(int tid, int pos) const; //index of the site at (tid, pos) or nsites if there isn't one
+};
+
+//struct-of-arrays storage for piled up sites.
+//per-base data for every site lives in one contiguous array each;
+//site i covers bases [offsets[i], offsets[i+1]).
+class Pileupcolumns{
+public:
+	std::vector<char> bases;
+	std::vector<char> quals;
+	std::vector<rgid_t> readgroups;
+	std::vector<uint64_t> offsets;
+	std::vector<int32_t> tids;
+	std::vector<int32_t> positions;
+	std::vector<char> refs;
+	std::vector<allelecounts_t> counts;
+	Pileupcolumns();
+	size_t size() const;
+	size_t num_bases() const;
+	Siteview site(size_t i) const;
+	Columnview view() const;
+	void push_back(int tid, int pos, char ref, const std::vector<char> &x, const std::vector<char> &q, const std::vector<rgid_t> &rgs);
+	void append(const Pileupcolumns &other); //other's sites go after ours
+	void clear();
+};
 
 //class for slurping in pileup data
+//in streaming mode nothing is slurped; every call to for_each_site re-reads the file,
+//so memory is bounded by pileup depth instead of genome length.
+//a compiled pileup can be saved with write_cache and memory-mapped back with Pileupdata(cachefile).
+//a cohort of alignment files becomes one set of patterns for fitting shared parameters.
 class Pileupdata{
 protected:
-	Pileup plp;
-	pileupdata_t data; //data[tid][pos] = (bases, counts, qualities, ref, readgroups)
+	Pileupcolumns data;
+	std::shared_ptr<void> mapping; //cache file, if data came from one
+	Columnview mapped; //views into mapping
+	std::map<std::string,int> name_map;
 	std::map<char,int> ref_counts;
-	void populate_data();
+	patterncounts_t patterns;
+	patternlist_t pattern_list;
+	rgpatternlist_t rg_pattern_list;
+	bool patterns_loaded;
+	bool streaming;
+	std::string filename;
+	std::string refname;
+	std::string region;
+	std::vector<std::string> readgroup_names; //readgroup_names[id] = RG
+	std::map<std::string,rgid_t> readgroup_ids;
+	void populate_data(Pileup &p);
+	void populate_data(MultiPileup &p);
 	void populate_data(std::vector<char> x, char ref, std::vector<char> quals);
+	void populate_sharded(int threads, int window);
+	void tally_site(size_t i); //update ref_counts and patterns
+	void stream_sites(Pileup &p, site_f f);
+	void add_site(Pileupcolumns &c, Pileup &p);
+	void load_readgroups(const std::vector<std::string> &names);
+	void add_pattern(const allelecounts_t &x, char ref);
+	rgid_t readgroup_id(const std::string &rg);
+	Columnview columns(); //data or mapped
+	void map_cache(std::string cachefile);
+	struct streaming_tag {};
+	Pileupdata(streaming_tag, std::string filename, std::string refname, std::string region);
 public:
 	std::vector<char> bases_at(int tid, int pos);
 	int depth_at(int tid, int pos);
 	int num_base(int tid, int pos, char base);
-	pileupdata_t get_data();
+	size_t num_sites();
+	Siteview site(size_t i); //ith site, in genomic order
+	Siteview site_at(int tid, int pos); //throws std::out_of_range if pos wasn't piled up
+	Columnview get_data();
 	std::map<std::string,int> get_name_map();
-	std::map<char,int> get_ref_counts();
+	std::map<char,int> get_ref_counts(); //streaming mode reads the file once to build them, with the patterns
+	const std::vector<std::string> &get_readgroups(); //indexed by rgid_t. in streaming mode, filled by the first pass over the file.
+	void for_each_site(site_f f); //calls f on every site, in order
+	const patterncounts_t &get_patterns(); //distinct (ref, counts) columns with multiplicities. streaming mode reads the file once to build them.
+	const patternlist_t &get_pattern_list(); //get_patterns in the same order, as a vector
+	const rgpatternlist_t &get_rg_pattern_list(); //patterns split by readgroup, from the sites. empty when sites aren't kept (cohorts, pattern-only caches)
+	static allelecounts_t count_alleles(const std::vector<char> &x); //non-ACGT bases are not counted
+	bool is_streaming();
+	static constexpr int default_window = 1000000; //bp per shard when piling up in parallel
+	void write_cache(std::string cachefile, bool patterns_only = false); //patterns_only drops the per-site data; EM only needs patterns. throws.
+	static const uint32_t cache_version = 1;
+	static Pileupdata open_streaming(std::string filename, std::string refname, std::string region = ""); //nothing is slurped. empty region means the whole file
 	Pileupdata(std::string filename, std::string refname, std::string region);
 	Pileupdata(std::string filename, std::string refname);
-	Pileupdata(Pileup p);
+	Pileupdata(std::string filename, std::string refname, int threads, int window = default_window); //needs an index to use more than 1 thread. throws if window <= 0
+	Pileupdata(Pileup &p); //piles up the rest of p
+	Pileupdata(const std::vector<std::string> &filenames, std::string refname); //every sample piled up in one pass. only patterns are kept: one per sample with bases at each site
+	Pileupdata(const std::vector<std::string> &filenames, std::string refname, std::string region);
 	Pileupdata(std::vector<char> x, char ref, std::vector<char> quals);
 	Pileupdata(std::vector<char> x);
+	explicit Pileupdata(std::string cachefile); //memory-map a file written by write_cache. throws.
 };
 
 
@@ -11,13 +11,15 @@
 #include <cerrno>
 #include <cstring>
 #include <limits>
-#include <boost/math/tools/roots.hpp>
+#include <numeric>
+#include "parallel.h"
+#include "gl_table.h"
 
 typedef Popstatem::theta_t theta_t;
 
 Popstatem::Popstatem(Pileupdata p, int ploidy) : plp(p), theta(std::make_tuple(0.1,Seqem::uniform_pi,1,0.1)),
-	em(std::bind(&Popstatem::q_function, this, std::placeholders::_1), std::bind(&Popstatem::m_function,this,std::placeholders::_1), theta),
-	ploidy(ploidy), m(ploidy), possible_gts(Genotype::enumerate_gts(ploidy)){
+	em(std::bind(&Popstatem::e_step, this, std::placeholders::_1), std::bind(&Popstatem::q_function, this, std::placeholders::_1), std::bind(&Popstatem::m_function,this,std::placeholders::_1), theta),
+	ploidy(ploidy), m(ploidy), possible_gts(Genotype::enumerate_gts(ploidy)), threads(meep_parallel::default_threads()), estep(ploidy), alpha_table(ploidy){
 	// possible_gts = Genotype::enumerate_gts(ploidy);
 }
 
@@ -25,252 +27,410 @@ Popstatem::Popstatem(Pileupdata p): Popstatem(p, 2){
 }
 
 Popstatem::Popstatem(std::string samfile, std::string refname, int ploidy) : plp(samfile, refname), theta(std::make_tuple(0.1,Seqem::uniform_pi,1,0.1)),
-	em(std::bind(&Popstatem::q_function, this, std::placeholders::_1), std::bind(&Popstatem::m_function,this,std::placeholders::_1), theta),
-	ploidy(ploidy), m(ploidy), possible_gts(Genotype::enumerate_gts(ploidy)){
+	em(std::bind(&Popstatem::e_step, this, std::placeholders::_1), std::bind(&Popstatem::q_function, this, std::placeholders::_1), std::bind(&Popstatem::m_function,this,std::placeholders::_1), theta),
+	ploidy(ploidy), m(ploidy), possible_gts(Genotype::enumerate_gts(ploidy)), threads(meep_parallel::default_threads()), estep(ploidy), alpha_table(ploidy){
 	// possible_gts = Genotype::enumerate_gts(ploidy);
 }
 
 Popstatem::Popstatem(std::string samfile, std::string refname) : Popstatem(samfile, refname, 2) {
 }
 
+Popstatem::Popstatem(const std::vector<std::string> &samfiles, std::string refname, int ploidy) : Popstatem(Pileupdata(samfiles, refname), ploidy) {
+}
+
+Popstatem::Popstatem(const std::vector<std::string> &samfiles, std::string refname) : Popstatem(samfiles, refname, 2) {
+}
+
 theta_t Popstatem::start(double stop){
-	return em.start(stop);
+	theta = em.start(stop);
+	return theta;
 }
 
-double Popstatem::q_function(theta_t theta){
-	double likelihood = 0.0;
-	pileupdata_t plpdata = plp.get_data();
-
-	for (pileupdata_t::iterator tid = plpdata.begin(); tid != plpdata.end(); ++tid){
-		for(std::vector<pileuptuple_t>::iterator pos = tid->begin(); pos != tid->end(); ++pos){
-			const std::vector<char> &x = std::get<0>(*pos);
-			for (std::vector<Genotype>::iterator g = possible_gts.begin(); g != possible_gts.end(); ++g){
-				likelihood += pg_x_given_theta(*g,x,theta);
+void Popstatem::set_max_iterations(int n){
+	em.set_max_iterations(n);
+}
+
+void Popstatem::set_acceleration(bool on){
+	em.set_acceleration(on);
+}
+
+int Popstatem::get_iterations(){
+	return em.get_iterations();
+}
+
+void Popstatem::set_threads(int n){
+	threads = n;
+}
+
+void Popstatem::set_tracing(bool on){
+	em.set_tracing(on);
+}
+
+void Popstatem::set_observer(em_observer_f f){
+	em.set_observer(f);
+}
+
+const EM_Trace &Popstatem::get_trace(){
+	return em.get_trace();
+}
+
+//the log likelihood, s and the GT_Matrix all come from one vector of genotype posteriors per pattern. EM evaluates q at every new
+//theta before stepping from it, so m_function always finds its statistics here.
+//each chunk of patterns gets its own partial sums, added up in chunk order at the end.
+void Popstatem::e_step(theta_t theta){
+	if (estep.valid && estep.theta == theta){
+		return;
+	}
+	const patternlist_t &patterns = plp.get_pattern_list();
+	size_t chunks = meep_parallel::num_chunks(patterns.size());
+	std::vector<double> partial_likelihood(chunks, 0.0);
+	std::vector<std::vector<double>> partial_s(chunks, std::vector<double>(ploidy + 1,0.0));
+	std::vector<GT_Matrix> partial_m(chunks, GT_Matrix(ploidy));
+	GL_Table table(possible_gts, std::get<3>(theta), std::get<1>(theta));
+	meep_parallel::parallel_chunks(patterns.size(), threads, [&](size_t chunk, size_t begin, size_t end){
+		std::vector<double> posteriors(possible_gts.size());
+		for (size_t i = begin; i < end; ++i){
+			char ref = std::get<0>(patterns[i].first);
+			const allelecounts_t &x = std::get<1>(patterns[i].first);
+			int weight = patterns[i].second;
+			partial_likelihood[chunk] += weight * table.posteriors(x, posteriors.data());
+			for (size_t j = 0; j < possible_gts.size(); ++j){
+				table.add_s(partial_s[chunk], x, j, weight * posteriors[j]);
 			}
+			load_matrix(partial_m[chunk], posteriors.data(), ref, weight);
+		}
+	});
+	estep.theta = theta;
+	estep.likelihood = std::accumulate(partial_likelihood.begin(), partial_likelihood.end(), 0.0);
+	estep.s.assign(ploidy + 1,0.0);
+	estep.m = GT_Matrix(ploidy);
+	for (size_t c = 0; c < chunks; ++c){
+		for (size_t k = 0; k < estep.s.size(); ++k){
+			estep.s[k] += partial_s[c][k];
 		}
+		estep.m += partial_m[c];
 	}
-	return likelihood;
+	estep.valid = true;
+}
+
+double Popstatem::q_function(theta_t theta){
+	e_step(theta);
+	return estep.likelihood;
 }
 
 theta_t Popstatem::m_function(theta_t theta){
 	//optimize epsilon and update gt matrix m
-	pileupdata_t plpdata = plp.get_data();
-	std::vector<double> s(3,0.0); //TODO:make this generic, depends on ploidy
-	GT_Matrix n;
-	for (auto tid : plpdata){
-		for(auto pos : tid){
-			std::vector<char> x = std::get<0>(pos);
-			char ref = std::get<3>(pos);
-			double eps = std::get<3>(theta);
-			std::map<char,double> pi = std::get<1>(theta);
-			Seqem::increment_s(s, x, possible_gts, std::make_tuple(eps),pi);
-			load_matrix(n,x,ref);
-		}
-	}
-	double epsilon = Seqem::calc_epsilon(s);
+	e_step(theta);
+	std::map<char,double> pi = std::get<1>(theta);
+	double epsilon = Seqem::calc_epsilon(estep.s);
 
-	m = n; //this must be set before theta, w, and pi can be optimized
-	std::cout << m << std::endl;
+	m = estep.m; //this must be set before theta, w, and pi can be optimized
+	alpha_table = Alpha_table(m, possible_gts, ploidy);
 
-	//optimize theta, w, and pi
-	double th = boost::math::tools::newton_raphson_iterate([this](const double& x){return std::make_tuple(dq_dtheta(x),ddq_dtheta(x));},std::get<0>(theta),0.0,10000.0,5);
-	double w = boost::math::tools::newton_raphson_iterate([this](const double& x){return std::make_tuple(dq_dw(x),ddq_dw(x));},std::get<2>(theta),-1000.0,100000.0,5);
+	//optimize theta, w, and pi jointly
+	mparams_t x = to_mparams(theta);
+	int newton_iterations = 0;
+	x = newton_mstep(x, newton_iterations);
+	em.note_nr_iterations(newton_iterations);
 
-	std::map<char,double> pi = std::get<1>(theta);
-	std::map<char,double> new_pi(pi);
+	double th = x[0];
+	double w = x[1];
+	std::map<char,double> new_pi;
 	double p = 0.0;
-	for (size_t i = 0; i < Genotype::alleles.size()-1; ++i){
-		char a = Genotype::alleles[i];
-		double max_pi = 1.0;
-		for (size_t j = 0; j < Genotype::alleles.size()-1; ++j){
-			char p_allele = Genotype::alleles[j];
-			max_pi -= (p_allele == a ? 0 : new_pi[p_allele]);
-		}
-		double optimum = boost::math::tools::newton_raphson_iterate([this,a](const double& x){return std::make_tuple(dq_dpi(a,x),ddq_dpi(a,x));},pi[a],0.0,max_pi,5);
-		std::cout << "allele:" << a << "\tpi:" << pi[a] <<"\toptimum:" << optimum  << std::endl;
-		new_pi[a] = optimum;
-		p += optimum;
+	for (size_t a = 0; a < Genotype::numalleles - 1; ++a){
+		new_pi[Genotype::alleles[a]] = x[2 + a];
+		p += x[2 + a];
 	}
 	new_pi[Genotype::alleles.back()] = 1 - p;
 
 	return std::make_tuple(th,new_pi,w,epsilon);
 }
 
-void Popstatem::load_matrix(GT_Matrix &m, std::vector<char> x, char ref){
-	for (auto g : possible_gts){
-		double pg_x = pg_x_given_theta(g,x,theta);
-		double pdata = pdata_given_theta(x,theta,possible_gts);
-		m(ref,g) += (pg_x / pdata);
-		// m(ref,g) += pg_x;
+Popstatem::mparams_t Popstatem::to_mparams(const theta_t &theta){
+	mparams_t x;
+	x[0] = std::get<0>(theta);
+	x[1] = std::get<2>(theta);
+	const std::map<char,double> &pi = std::get<1>(theta);
+	for (size_t a = 0; a < Genotype::numalleles - 1; ++a){
+		auto it = pi.find(Genotype::alleles[a]);
+		x[2 + a] = (it == pi.end() ? 0.0 : it->second);
 	}
+	return x;
 }
 
-double Popstatem::dq_dtheta(double th){
-	std::map<char,double> pi = std::get<1>(theta);
-	double refweight = std::get<2>(theta);
-	double dq = 0.0;
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				for (int k = 0; k < it->second; ++k){ //add pi/(alpha + 0) twice for het; pi/(alpha + 1) for homozygote
-					dq += m[i][j] * (pi[allele]/(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k));
+Popstatem::Alpha_table::Alpha_table(int ploidy) : ploidy(ploidy), weights(Genotype::numalleles * Genotype::numalleles * ploidy, 0.0), total(0.0) {
+}
+
+Popstatem::Alpha_table::Alpha_table(const GT_Matrix &m, const std::vector<Genotype> &gts, int ploidy) : Alpha_table(ploidy) {
+	for (size_t i = 0; i < Genotype::numalleles; ++i){
+		const double *row = m[i];
+		for (size_t j = 0; j < gts.size(); ++j){
+			total += row[j];
+			for (size_t a = 0; a < Genotype::numalleles; ++a){
+				double *w = weights.data() + (i * Genotype::numalleles + a) * ploidy;
+				for (int k = 0; k < gts[j].count(a); ++k){
+					w[k] += row[j];
 				}
 			}
-			for (int l = 0; l < ploidy; ++l){ //subtract alpha, alpha + 1
-				dq -= m[i][j] * (1.0 / ref_alpha(refweight, th) + l);	
-			}
 		}
 	}
-	return dq;
 }
 
-double Popstatem::ddq_dtheta(double th){
-	double ddq = 0.0;
-	std::map<char,double> pi = std::get<1>(theta);
-	double refweight = std::get<2>(theta);
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (int l = 0; l < ploidy; ++l){ //add  1/alpha, 1/(alpha + 1)
-				ddq += m[i][j] * (1.0 / pow(ref_alpha(refweight, th) + l,2));	
+//for genotype g with c_a copies of allele a at a site with reference r,
+//	log P(g | r) = sum_a sum_{k < c_a} log(alpha_a + k) - sum_{l < ploidy} log(theta + w + l) + const
+//where alpha_a = theta * pi_a + (a == r ? w : 0) and pi_last = 1 - the other pis.
+//each log term contributes d alpha / alpha to the gradient and d2 alpha / alpha - (d alpha)(d alpha)^T / alpha^2
+//to the hessian. alpha is linear in w and in pi, so d2 alpha is just the theta, pi cross terms: 1 for pi_a, -1 for pi_last.
+//the sums over k only need weight / v and weight / v^2, so the gradient and hessian are assembled once per (i, a).
+double Popstatem::Alpha_table::evaluate(const mparams_t &x, mparams_t *grad, mhessian_t *hess) const{
+	const double infeasible = -std::numeric_limits<double>::infinity();
+	const size_t numalleles = Genotype::numalleles;
+	const size_t last = numalleles - 1;
+	double th = x[0];
+	double w = x[1];
+	std::array<double,Genotype::numalleles> pi;
+	pi[last] = 1.0;
+	for (size_t a = 0; a < last; ++a){
+		pi[a] = x[2 + a];
+		pi[last] -= pi[a];
+	}
+	if (!(th > 0.0) || *std::min_element(pi.begin(), pi.end()) < 0.0){
+		return infeasible;
+	}
+	if (grad != nullptr){
+		grad->fill(0.0);
+		for (mparams_t &row : *hess){
+			row.fill(0.0);
+		}
+	}
+	double q = 0.0;
+	for (size_t i = 0; i < numalleles; ++i){ //for each reference base
+		for (size_t a = 0; a < numalleles; ++a){ //for each allele
+			double alpha = th * pi[a] + (a == i ? w : 0.0);
+			const double *wt = weight(i, a);
+			double s1 = 0.0; //sum of weight / v
+			double s2 = 0.0; //sum of weight / v^2
+			for (int k = 0; k < ploidy; ++k){
+				if (wt[k] == 0.0){
+					continue;
+				}
+				double v = alpha + k;
+				if (!(v > 0.0)){
+					return infeasible;
+				}
+				q += wt[k] * std::log(v);
+				s1 += wt[k] / v;
+				s2 += wt[k] / (v * v);
+			}
+			if (grad == nullptr || s1 == 0.0){
+				continue;
 			}
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				for (int k = 0; k < it->second; ++k){ //add pi/(alpha + 0) twice for het; pi/(alpha + 1) for homozygote
-					ddq -= m[i][j] * (pow(pi[allele],2)/pow(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k,2));
+			mparams_t dalpha;
+			dalpha.fill(0.0);
+			dalpha[0] = pi[a];
+			dalpha[1] = (a == i ? 1.0 : 0.0);
+			for (size_t p = 0; p < last; ++p){
+				dalpha[2 + p] = (a == p ? th : (a == last ? -th : 0.0));
+			}
+			for (size_t p = 0; p < num_mparams; ++p){
+				(*grad)[p] += s1 * dalpha[p];
+				for (size_t r = 0; r < num_mparams; ++r){
+					(*hess)[p][r] -= s2 * dalpha[p] * dalpha[r];
 				}
 			}
+			for (size_t p = 0; p < last; ++p){
+				double d2 = (a == p ? 1.0 : (a == last ? -1.0 : 0.0));
+				(*hess)[0][2 + p] += s1 * d2;
+				(*hess)[2 + p][0] += s1 * d2;
+			}
 		}
 	}
-	return ddq;
-}
-
-double Popstatem::dq_dw(double w){
-	double dq = 0.0;
-	double th = std::get<0>(theta);
-	std::map<char,double> pi = std::get<1>(theta);
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				if (allele == Genotype::alleles[i]){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						dq += m[i][j] * (1.0/(allele_alpha(allele,(char)Genotype::alleles[i],w,th,pi) + k));
-					}
-				}
+	for (int l = 0; l < ploidy; ++l){ //theta + w is the sum of the alphas
+		double v = th + w + l;
+		if (!(v > 0.0)){
+			return infeasible;
+		}
+		q -= total * std::log(v);
+		if (grad == nullptr){
+			continue;
+		}
+		(*grad)[0] -= total / v;
+		(*grad)[1] -= total / v;
+		for (size_t p = 0; p < 2; ++p){
+			for (size_t r = 0; r < 2; ++r){
+				(*hess)[p][r] += total / (v * v);
 			}
 		}
 	}
-	return dq;	
+	return q;
 }
 
-double Popstatem::ddq_dw(double w){
-	double ddq = 0.0;
-	double th = std::get<0>(theta);
-	std::map<char,double> pi = std::get<1>(theta);
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				if (allele == Genotype::alleles[i]){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						ddq -= m[i][j] * (1.0/pow(allele_alpha(allele,(char)Genotype::alleles[i],w,th,pi) + k,2));
-					}
+double Popstatem::mstep_objective(const mparams_t &x){
+	return alpha_table.evaluate(x, nullptr, nullptr);
+}
+
+double Popstatem::mstep_derivatives(const mparams_t &x, mparams_t &grad, mhessian_t &hess){
+	return alpha_table.evaluate(x, &grad, &hess);
+}
+
+//damped newton: solve (lambda I - hess) d = grad, raising lambda until that is positive definite so d
+//goes uphill, then backtrack along d until the step stays feasible and gains enough (armijo).
+//stops when the predicted gain grad . d is negligible or no step along d helps, and keeps x when the
+//derivatives aren't finite or no lambda up to max_newton_damping times the hessian's scale works.
+Popstatem::mparams_t Popstatem::newton_mstep(mparams_t x, int &iterations){
+	const size_t n = num_mparams;
+	mparams_t grad;
+	mhessian_t hess;
+	double q = mstep_derivatives(x, grad, hess);
+	iterations = 0;
+	if (!std::isfinite(q)){
+		return x;
+	}
+	while (iterations < max_newton_iterations){
+		++iterations;
+		bool finite = true;
+		double scale = 0.0;
+		for (size_t p = 0; p < n; ++p){
+			finite = finite && std::isfinite(grad[p]);
+			for (size_t r = 0; r < n; ++r){
+				finite = finite && std::isfinite(hess[p][r]);
+			}
+			scale = std::max(scale, std::abs(hess[p][p]));
+		}
+		if (!finite){
+			break; //no damping makes a nan or inf hessian factor
+		}
+		std::vector<double> a(n * n);
+		std::vector<double> b(grad.begin(), grad.end());
+		std::vector<double> d;
+		bool solved = false;
+		for (double lambda = 0.0; lambda <= max_newton_damping * (1.0 + scale); lambda = (lambda == 0.0 ? 1e-10 * (1.0 + scale) : lambda * 10)){
+			for (size_t p = 0; p < n; ++p){
+				for (size_t r = 0; r < n; ++r){
+					a[p * n + r] = -hess[p][r] + (p == r ? lambda : 0.0);
 				}
 			}
+			if (meep_math::cholesky_solve(a, b, d)){
+				solved = true;
+				break;
+			}
+		}
+		if (!solved){
+			break;
 		}
+		double gain = std::inner_product(grad.begin(), grad.end(), d.begin(), 0.0);
+		if (gain <= newton_tolerance * (1.0 + std::abs(q))){
+			break;
+		}
+		mparams_t next;
+		double next_q = q;
+		bool stepped = false;
+		for (double t = 1.0; t > 1e-12; t /= 2){
+			for (size_t p = 0; p < n; ++p){
+				next[p] = x[p] + t * d[p];
+			}
+			next_q = mstep_objective(next);
+			if (next_q >= q + 1e-4 * t * gain){
+				stepped = true;
+				break;
+			}
+		}
+		if (!stepped){
+			break;
+		}
+		x = next;
+		q = mstep_derivatives(x, grad, hess);
 	}
-	return ddq;	
+	return x;
 }
 
-double Popstatem::dq_dpi(char a, double pi){
-	double dq = 0.0;
-	double th = std::get<0>(theta);
-	std::map<char,double> p = std::get<1>(theta);
-	double refweight = std::get<2>(theta);
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	double pi_last = 1.0;
-	for (int i = 0; i < numalleles - 1; ++i){
-		char allele = Genotype::alleles[i];
-		pi_last -= (allele == a ? pi : p[allele]);
+void Popstatem::load_matrix(GT_Matrix &m, std::vector<char> x, char ref){
+	load_matrix(m, Pileupdata::count_alleles(x), ref, 1);
+}
+
+void Popstatem::load_matrix(GT_Matrix &m, const allelecounts_t &x, char ref, int weight){
+	GL_Table table(possible_gts, std::get<3>(theta), std::get<1>(theta));
+	std::vector<double> posteriors(possible_gts.size());
+	table.posteriors(x, posteriors.data());
+	load_matrix(m, posteriors.data(), ref, weight);
+}
+
+void Popstatem::load_matrix(GT_Matrix &m, const double *posteriors, char ref, int weight){
+	int i = Genotype::allele_index(ref);
+	if (i < 0){
+		return;
 	}
-	// pi_last = (pi_last < 0 ? 0 : pi_last);
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				if (allele == a){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						dq += m[i][j] * th /(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k);
-					}
-				}
-				else if(allele == Genotype::alleles.back()){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						dq -= m[i][j] * th /(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi_last) + k);
-					}	
-				}
-			}
-		}
+	double *row = m[i];
+	for (size_t j = 0; j < m.cols(); ++j){
+		row[j] += weight * posteriors[j];
 	}
-	return dq;	
 }
 
-double Popstatem::ddq_dpi(char a, double pi){
-	double ddq = 0.0;
-	double th = std::get<0>(theta);
-	std::map<char,double> p = std::get<1>(theta);
-	double refweight = std::get<2>(theta);
-	int numalleles = Genotype::alleles.size();
-	int numgts = possible_gts.size();
-	double pi_last = 1.0;
-	for (int i = 0; i < numalleles - 1; ++i){
-		char allele = Genotype::alleles[i];
-		pi_last -= (allele == a ? pi : p[allele]);
+double Popstatem::single_derivative(mparams_t x, size_t p, bool second){
+	mparams_t grad;
+	mhessian_t hess;
+	if (!std::isfinite(alpha_table.evaluate(x, &grad, &hess))){
+		return std::numeric_limits<double>::quiet_NaN();
 	}
-	// pi_last = (pi_last < 0 ? 0 : pi_last);
-	for (int i = 0; i < numalleles; ++i){ //for each reference base
-		for (int j = 0; j < numgts; ++j){ //for each genotype
-			Genotype g = possible_gts[j];
-			for (auto it = g.gt.begin(); it != g.gt.end(); ++it){ //for each base in genotype
-				char allele = it -> first;
-				if (allele == a){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						ddq -= m[i][j] * pow(th,2) / pow(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi) + k,2);
-					}
-				}
-				else if (allele == Genotype::alleles.back()){
-					for (int k = 0; k < it->second; ++k){ //add 1/(alpha + 0) or +0 and +1 for homozygote
-						ddq -= m[i][j] * pow(th,2) / pow(allele_alpha(allele,Genotype::alleles[i],refweight,th,pi_last) + k,2);
-					}
-				}
-			}
-		}
+	return second ? hess[p][p] : grad[p];
+}
+
+double Popstatem::dq_dtheta(double th){
+	mparams_t x = to_mparams(theta);
+	x[0] = th;
+	return single_derivative(x, 0, false);
+}
+
+double Popstatem::ddq_dtheta(double th){
+	mparams_t x = to_mparams(theta);
+	x[0] = th;
+	return single_derivative(x, 0, true);
+}
+
+double Popstatem::dq_dw(double w){
+	mparams_t x = to_mparams(theta);
+	x[1] = w;
+	return single_derivative(x, 1, false);
+}
+
+double Popstatem::ddq_dw(double w){
+	mparams_t x = to_mparams(theta);
+	x[1] = w;
+	return single_derivative(x, 1, true);
+}
+
+//pi_last takes up the slack, so a can't be the last allele
+double Popstatem::dq_dpi(char a, double pi){
+	int i = Genotype::allele_index(a);
+	if (i < 0 || i >= (int)Genotype::numalleles - 1){
+		throw std::invalid_argument(std::string("no pi parameter for allele ") + a);
+	}
+	mparams_t x = to_mparams(theta);
+	x[2 + i] = pi;
+	return single_derivative(x, 2 + i, false);
+}
+
+double Popstatem::ddq_dpi(char a, double pi){
+	int i = Genotype::allele_index(a);
+	if (i < 0 || i >= (int)Genotype::numalleles - 1){
+		throw std::invalid_argument(std::string("no pi parameter for allele ") + a);
 	}
-	return ddq;	
+	mparams_t x = to_mparams(theta);
+	x[2 + i] = pi;
+	return single_derivative(x, 2 + i, true);
 }
 
-void Popstatem::apply_over_gt(std::function<void (int, int, std::vector<Genotype>::iterator)> f){
+//f(ref index, genotype index, allele index, copies of the allele) for every allele in every genotype
+void Popstatem::apply_over_gt(std::function<void (int, int, int, int)> f){
 	int numalleles = Genotype::alleles.size();
 	int numgts = possible_gts.size();
 	for (int i = 0; i < numalleles; ++i){
 		for(int j = 0; j < numgts; ++j){
-			Genotype g = possible_gts[j];
-			for(std::vector<Genotype>::iterator it = g.gt.begin(); it != g.gt.end(); ++it){
-				f(i,j,it);
+			const Genotype &g = possible_gts[j];
+			for (int a = 0; a < numalleles; ++a){
+				if (g.count(a) != 0){
+					f(i,j,a,g.count(a));
+				}
 			}
 		}
 	}
@@ -295,6 +455,20 @@ double Popstatem::pg_x_given_theta(Genotype g, std::vector<char> x, theta_t thet
 	return Seqem::pg_x_given_theta(g,x,std::make_tuple(e),p);
 }
 
+double Popstatem::pg_x_given_theta(Genotype g, const allelecounts_t &x, theta_t theta){
+	double e = std::get<3>(theta);
+	std::map<char,double> p = std::get<1>(theta);
+	return Seqem::pg_x_given_theta(g,x,std::make_tuple(e),p);
+}
+
+double Popstatem::pdata_given_theta(const allelecounts_t &x, theta_t theta, std::vector<Genotype> gts){
+	double p = 0.0;
+	for (auto g : gts){
+		p += pg_x_given_theta(g, x, theta);
+	}
+	return p;
+}
+
 double Popstatem::pdata_given_theta(std::vector<char> x, theta_t theta, std::vector<Genotype> gts){
 	double p = 0.0;
 	for (auto g : gts){
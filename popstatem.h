@@ -6,6 +6,7 @@
 #include "genotype.h"
 #include "gt_matrix.h"
 #include <vector>
+#include <array>
 
 // template<int alleles, int gts>
 // using GT_Matrix = std::array<std::array<double,gts>,alleles>;
@@ -14,23 +15,71 @@
 class Popstatem{
 public:
 	typedef std::tuple<double, std::map<char, double>, double, double> theta_t; //theta, pi, refweight, epsilon	
+	//everything q_function and m_function need at one theta, from one pass over the patterns
+	struct Estep{
+		theta_t theta;
+		bool valid;
+		double likelihood; //log P(data)
+		std::vector<double> s; //expected over genotype posteriors
+		GT_Matrix m; //sum of genotype posteriors by reference allele
+		Estep(int ploidy) : theta(), valid(false), likelihood(0.0), s(ploidy + 1,0.0), m(ploidy) {};
+	};
+	static constexpr size_t num_mparams = Genotype::numalleles + 1; //theta, w, and pi for every allele but the last
+	typedef std::array<double,num_mparams> mparams_t;
+	typedef std::array<mparams_t,num_mparams> mhessian_t;
+	static constexpr int max_newton_iterations = 100;
+	static constexpr double newton_tolerance = 1e-12; //stop once the predicted gain is this small relative to q
+	static constexpr double max_newton_damping = 1e12; //largest lambda tried, relative to the hessian's diagonal
+	//a GT_Matrix folded down to what the M step needs. at reference i every genotype sees the same alphas,
+	//so the terms of q are sum over (i, a, k) of weight(i,a,k) * log(alpha_a + k), where
+	//weight(i,a,k) = sum of m[i][j] over the genotypes j with more than k copies of allele a.
+	struct Alpha_table{
+		int ploidy;
+		std::vector<double> weights; //numalleles x numalleles x ploidy, row major
+		double total; //sum of m; weighs the normalizing term
+		Alpha_table(int ploidy);
+		Alpha_table(const GT_Matrix &m, const std::vector<Genotype> &gts, int ploidy);
+		const double *weight(size_t i, size_t a) const {return weights.data() + (i * Genotype::numalleles + a) * ploidy;}; //ploidy values, one per k
+		double evaluate(const mparams_t &x, mparams_t *grad, mhessian_t *hess) const; //the part of q that depends on x; -inf outside the feasible region. grad and hess are skipped when null
+	};
+	static mparams_t to_mparams(const theta_t &theta);
 protected:
 	Pileupdata plp;
-	theta_t theta;
+	theta_t theta; //initial guess until start() returns, then its result
 	EM<double,std::map<char,double>,double,double> em;
 	int ploidy;
 	GT_Matrix m;
 	std::vector<Genotype> possible_gts;
+	int threads; //for the E step
+	Estep estep;
+	Alpha_table alpha_table; //m, folded by m_function
+	double single_derivative(mparams_t x, size_t p, bool second); //d q / d x[p] or d2 q / d x[p]^2
 public:
 	Popstatem(Pileupdata p, int ploidy);
 	Popstatem(Pileupdata p);
 	Popstatem(std::string samfile, std::string refname);
 	Popstatem(std::string samfile, std::string refname, int ploidy);
+	Popstatem(const std::vector<std::string> &samfiles, std::string refname); //one set of parameters shared by every sample
+	Popstatem(const std::vector<std::string> &samfiles, std::string refname, int ploidy);
 	theta_t start(double stop);
-	double q_function(theta_t theta);
+	void set_max_iterations(int n);
+	void set_acceleration(bool on); //SQUAREM; off by default
+	int get_iterations(); //M steps taken by the last start()
+	void set_threads(int n); //defaults to every hardware thread
+	void set_tracing(bool on); //record an EM_Record per iteration; off by default
+	void set_observer(em_observer_f f);
+	const EM_Trace &get_trace();
+	void e_step(theta_t theta); //fill estep unless it already holds theta
+	double q_function(theta_t theta); //log likelihood of the patterns
 	theta_t m_function(theta_t theta);
-	void load_matrix(GT_Matrix &m, std::vector<char> x, char ref);
-	void apply_over_gt(std::function<void (int, int, std::vector<Genotype>::iterator)> f);
+	void load_matrix(GT_Matrix &m, std::vector<char> x, char ref); //posteriors at the member theta
+	void load_matrix(GT_Matrix &m, const allelecounts_t &x, char ref, int weight); //weight = # sites with pattern (ref, x)
+	static void load_matrix(GT_Matrix &m, const double *posteriors, char ref, int weight); //m[ref] += weight * P(g | x); sites with an N reference are skipped
+	void apply_over_gt(std::function<void (int, int, int, int)> f); //f(ref, genotype, allele, copies)
+	double mstep_objective(const mparams_t &x); //the part of q that depends on theta, w and pi, from alpha_table. -inf outside the feasible region
+	double mstep_derivatives(const mparams_t &x, mparams_t &grad, mhessian_t &hess); //returns mstep_objective(x)
+	mparams_t newton_mstep(mparams_t x, int &iterations); //maximize mstep_objective from x
+	//single coordinates of the gradient and hessian diagonal around the member theta
 	double dq_dtheta(double th);
 	double ddq_dtheta(double th);
 	double dq_dw(double w);
@@ -41,7 +90,9 @@ public:
 	static double allele_alpha(char allele, char ref, double ref_weight, double theta, double pi);
 	static double ref_alpha(double ref_weight, double theta);
 	static double pg_x_given_theta(Genotype g, std::vector<char> x, theta_t theta); //not log space
+	static double pg_x_given_theta(Genotype g, const allelecounts_t &x, theta_t theta); //not log space
 	static double pdata_given_theta(std::vector<char> x, theta_t theta, std::vector<Genotype> possible_gts);
+	static double pdata_given_theta(const allelecounts_t &x, theta_t theta, std::vector<Genotype> possible_gts);
 
 };
 
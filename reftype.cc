@@ -1,35 +1,59 @@
 #include "reftype.h"
 #include <stdexcept>
 #include <stdlib.h>
+#include <algorithm>
 
-Reftype::Reftype(std::string reference_name) : ref(){
-	faidx_t* faidx = fai_load(reference_name.c_str());
-	if (faidx == nullptr){
-		throw std::runtime_error("error loading reference");
-	}
-	faidx_p = faidx;
+Reftype::Reftype(std::string reference_name, int window_size, size_t max_windows) : faidx_p(load(reference_name)), prefetch_faidx_p(load(reference_name)), ref(), ref_len(), region(), window_size(window_size), max_windows(max_windows), current_key(), current_window(nullptr), current_prefetched(false) {
+}
+
+Reftype::Reftype(faidx_t* faidx_p) : faidx_p(faidx_p, &fai_destroy), prefetch_faidx_p(), ref(), ref_len(), region(), window_size(default_window_size), max_windows(default_max_windows), current_key(), current_window(nullptr), current_prefetched(false) {
 }
 
-Reftype::Reftype(faidx_t* faidx_p) : faidx_p(faidx_p), ref() {
+Reftype::Reftype() : faidx_p(), prefetch_faidx_p(), ref(), ref_len(), region(), window_size(default_window_size), max_windows(default_max_windows), current_key(), current_window(nullptr), current_prefetched(false) {
 }
 
-Reftype::Reftype() : faidx_p(nullptr), ref(){
+Reftype::Reftype(const Reftype &other) : faidx_p(other.faidx_p), prefetch_faidx_p(), ref(other.ref), ref_len(other.ref_len), region(other.region), window_size(other.window_size), max_windows(other.max_windows), seq_lens(other.seq_lens), current_key(), current_window(nullptr), current_prefetched(false) {
 }
 
-Reftype::~Reftype(){
-	if (faidx_p != nullptr){
-		fai_destroy(faidx_p);
+Reftype &Reftype::operator=(const Reftype &other){
+	if (this != &other){
+		if (pending.valid()){
+			pending.wait();
+		}
+		faidx_p = other.faidx_p;
+		prefetch_faidx_p.reset();
+		ref = other.ref;
+		ref_len = other.ref_len;
+		region = other.region;
+		window_size = other.window_size;
+		max_windows = other.max_windows;
+		windows.clear();
+		window_index.clear();
+		seq_lens = other.seq_lens;
+		pending = std::shared_future<std::string>();
+		current_window = nullptr;
+		current_prefetched = false;
 	}
+	return *this;
+}
+
+std::shared_ptr<faidx_t> Reftype::load(std::string reference_name){
+	faidx_t* faidx = fai_load(reference_name.c_str());
+	if (faidx == nullptr){
+		throw std::runtime_error("error loading reference");
+	}
+	return std::shared_ptr<faidx_t>(faidx, &fai_destroy);
 }
 
 std::string Reftype::get_ref(std::string region){
 	if (region != this->region){
 		this->region = region;
-		ref_p = fai_fetch(faidx_p,region.c_str(),&ref_len);
+		char* ref_p = fai_fetch(faidx_p.get(),region.c_str(),&ref_len);
 		if (ref_p == nullptr){
 			throw std::runtime_error("error getting ref");
 		}
 		ref.assign(ref_p,ref_len);
+		free(ref_p);
 	}
 	return ref;
 }
@@ -38,5 +62,105 @@ int Reftype::get_ref_len(){
 	return ref_len;
 }
 
+int Reftype::get_seq_len(const std::string &chr){
+	auto it = seq_lens.find(chr);
+	if (it == seq_lens.end()){
+		int len = faidx_seq_len(faidx_p.get(), chr.c_str());
+		if (len < 0){
+			throw std::runtime_error("error getting length of " + chr);
+		}
+		it = seq_lens.insert(std::make_pair(chr, len)).first;
+	}
+	return it->second;
+}
+
+bool Reftype::select_window(const std::string &chr, int pos){
+	if (pos < 0){
+		return false;
+	}
+	int w = pos / window_size;
+	if (current_window == nullptr || w != current_key.second || chr != current_key.first){
+		if (pos >= get_seq_len(chr)){
+			return false;
+		}
+		current_window = &get_window(chr, w);
+		current_key = std::make_pair(chr, w);
+		current_prefetched = false;
+	}
+	int offset = pos - w * window_size;
+	if (offset >= (int)current_window->size()){
+		return false;
+	}
+	if (!current_prefetched && offset >= window_size / 2){
+		current_prefetched = true;
+		prefetch(chr, w + 1);
+	}
+	return true;
+}
+
+char Reftype::get_base(const std::string &chr, int pos){
+	if (!select_window(chr, pos)){
+		return '\0';
+	}
+	return (*current_window)[pos - current_key.second * window_size];
+}
 
+const char *Reftype::get_seq(const std::string &chr, int pos, int *len){
+	if (!select_window(chr, pos)){
+		*len = 0;
+		return nullptr;
+	}
+	int offset = pos - current_key.second * window_size;
+	*len = current_window->size() - offset;
+	return current_window->data() + offset;
+}
 
+const std::string &Reftype::get_window(const std::string &chr, int w){
+	windowkey_t key = std::make_pair(chr, w);
+	auto it = window_index.find(key);
+	if (it != window_index.end()){
+		windows.splice(windows.begin(), windows, it->second);
+	}
+	else if (pending.valid() && pending_key == key){
+		cache_window(key, pending.get());
+		pending = std::shared_future<std::string>();
+	}
+	else{
+		int beg = w * window_size;
+		cache_window(key, fetch(faidx_p.get(), chr, beg, std::min(beg + window_size, get_seq_len(chr))));
+	}
+	return windows.front().second;
+}
+
+void Reftype::cache_window(const windowkey_t &key, std::string seq){
+	windows.emplace_front(key, std::move(seq));
+	window_index[key] = windows.begin();
+	while (windows.size() > max_windows){
+		window_index.erase(windows.back().first);
+		windows.pop_back();
+	}
+}
+
+void Reftype::prefetch(const std::string &chr, int w){
+	windowkey_t key = std::make_pair(chr, w);
+	int beg = w * window_size;
+	if (prefetch_faidx_p == nullptr || beg >= get_seq_len(chr) || window_index.count(key) != 0 || (pending.valid() && pending_key == key)){
+		return;
+	}
+	if (pending.valid()){
+		pending.wait(); //only one fetch in flight on the prefetch handle
+	}
+	pending_key = key;
+	pending = std::async(std::launch::async, &Reftype::fetch, prefetch_faidx_p.get(), chr, beg, std::min(beg + window_size, get_seq_len(chr))).share();
+}
+
+std::string Reftype::fetch(faidx_t* fai, std::string chr, int beg, int end){
+	int len;
+	char* seq = faidx_fetch_seq(fai, chr.c_str(), beg, end - 1, &len);
+	if (seq == nullptr){
+		throw std::runtime_error("error getting ref");
+	}
+	std::string s(seq, len);
+	free(seq);
+	return s;
+}
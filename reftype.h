@@ -3,23 +3,55 @@
 
 #include <htslib/faidx.h>
 #include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <future>
+#include <utility>
+#include <cstddef>
 
+typedef std::pair<std::string,int> windowkey_t; //(chr, window number)
+
+//reference access through a bounded LRU cache of fixed-size windows.
+//when a lookup gets into the second half of a window the next window is fetched on another thread.
 class Reftype{
 protected:
-	faidx_t* faidx_p;
-	char* ref_p;
+	std::shared_ptr<faidx_t> faidx_p;
+	std::shared_ptr<faidx_t> prefetch_faidx_p; //faidx_t isn't thread safe, so prefetching gets its own handle
 	std::string ref;
 	int ref_len;
 	std::string region;
+	int window_size;
+	size_t max_windows;
+	std::list<std::pair<windowkey_t,std::string>> windows; //most recently used first
+	std::map<windowkey_t,std::list<std::pair<windowkey_t,std::string>>::iterator> window_index;
+	std::map<std::string,int> seq_lens;
+	windowkey_t pending_key;
+	std::shared_future<std::string> pending;
+	windowkey_t current_key; //most recently used window, so consecutive lookups skip the cache
+	const std::string *current_window;
+	bool current_prefetched;
+	bool select_window(const std::string &chr, int pos); //make the window holding pos current; false if pos is off the end of chr
+	const std::string &get_window(const std::string &chr, int w);
+	void prefetch(const std::string &chr, int w);
+	void cache_window(const windowkey_t &key, std::string seq);
+	static std::string fetch(faidx_t* fai, std::string chr, int beg, int end); //0-based, half open
+	static std::shared_ptr<faidx_t> load(std::string reference_name);
 public:
-	Reftype(std::string reference_name);
+	Reftype(std::string reference_name, int window_size = default_window_size, size_t max_windows = default_max_windows);
 	Reftype(faidx_t* faidx_p);
 	Reftype();
-	~Reftype();
+	Reftype(const Reftype &other); //shares the handles but not the cache; copies don't prefetch
+	Reftype &operator=(const Reftype &other);
 	std::string get_ref(std::string region); //update ref if necessary, otherwise do nothing. then return ref. throws.
 	int get_ref_len();
+	char get_base(const std::string &chr, int pos); //'\0' if pos is off the end of chr. throws.
+	const char *get_seq(const std::string &chr, int pos, int *len); //view of chr from pos to the end of its window; valid until the next call. throws.
+	int get_seq_len(const std::string &chr); //throws
+	static constexpr int default_window_size = 1 << 16;
+	static constexpr size_t default_max_windows = 16;
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
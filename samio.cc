@@ -1,5 +1,11 @@
 #include "samio.h"
+#include "htspool.h"
 #include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <limits>
 
 SamReader::SamReader(nullptr_t nullp) : in(nullptr), idx(nullptr), iter(nullptr), header(nullptr){
 }
@@ -46,6 +52,8 @@ void SamReader::open(std::string filename_in){
         throw std::runtime_error("error, fail to open");
     }
     this->in = htsin;
+    this->filename = filename_in;
+    HtsPool::attach(htsin);
 
     htsheader = sam_hdr_read(htsin);
     if (htsheader == NULL || htsheader->n_targets == 0){
@@ -53,23 +61,218 @@ void SamReader::open(std::string filename_in){
     	throw std::runtime_error("error, no header");
     }
     this->header = htsheader;
+    load_readgroups();
+}
+
+//intern every @RG ID in header order so ids are the same for every reader of a file
+void SamReader::load_readgroups(){
+	std::istringstream text(std::string(header->text, header->l_text));
+	for (std::string line; std::getline(text, line);){
+		if (line.compare(0,4,"@RG\t") != 0){
+			continue;
+		}
+		std::istringstream fields(line);
+		for (std::string field; std::getline(fields, field, '\t');){
+			if (field.compare(0,3,"ID:") == 0){
+				intern_readgroup(field.substr(3));
+				break;
+			}
+		}
+	}
+}
+
+rgid_t SamReader::intern_readgroup(const std::string &rg){
+	auto it = readgroup_ids.find(rg);
+	if (it != readgroup_ids.end()){
+		return it->second;
+	}
+	if (readgroups.size() > std::numeric_limits<rgid_t>::max()){
+		throw std::runtime_error("too many readgroups");
+	}
+	rgid_t id = readgroups.size();
+	readgroups.push_back(rg);
+	readgroup_ids[rg] = id;
+	return id;
+}
+
+bool SamReader::is_cram(){
+	return in != nullptr && in->format.format == cram;
+}
+
+//CRAM stores bases as differences from the reference, so it needs the same fasta Reftype reads
+void SamReader::set_reference(std::string reffile){
+	if (!is_cram()){
+		return;
+	}
+	if (hts_set_opt(in, CRAM_OPT_REFERENCE, reffile.c_str()) != 0){
+		throw std::runtime_error("error setting CRAM reference " + reffile);
+	}
+}
+
+//without SAM_AUX we don't need MD/NM either, so don't generate them
+void SamReader::set_required_fields(int fields){
+	if (!is_cram()){
+		return;
+	}
+	if (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, fields) != 0){
+		throw std::runtime_error("error setting required CRAM fields");
+	}
+	if ((fields & SAM_AUX) == 0 && hts_set_opt(in, CRAM_OPT_DECODE_MD, 0) != 0){
+		throw std::runtime_error("error disabling CRAM MD generation");
+	}
 }
 
 //set in and header and idx and iter
+//regions are sorted and merged so each BGZF block is only read once
 void SamReader::open(std::string filename_in, std::string region){
 	open(filename_in);
-    hts_idx_t* idx = sam_index_load(this->in, filename_in.c_str()); //&hts_idx_destroy
-    if (idx != nullptr){
-    	//error
-    	throw std::runtime_error("error");
+	load_index();
+
+    this->intervals = merge_intervals(parse_regions(region));
+    std::vector<std::string> regions;
+    for (const interval_t &i : intervals){
+    	regions.push_back(get_ref_name(std::get<0>(i)) + ":" + std::to_string(std::get<1>(i) + 1) + "-" + std::to_string(std::get<2>(i)));
+    }
+    std::vector<char*> regarray;
+    for (std::string &r : regions){
+    	regarray.push_back(&r[0]);
     }
-    this->idx = idx;
 
-    hts_itr_t* iter = sam_itr_querys(idx, header, region.c_str()); //&hts_itr_destroy
-    if (iter != nullptr){
-    	throw std::runtime_error("error");
+    hts_itr_t* iter = sam_itr_regarray(idx, header, regarray.data(), regarray.size()); //&hts_itr_destroy
+    if (iter == nullptr){
+    	throw std::runtime_error("error querying region " + region);
     }
     this->iter = iter;
+    this->region = region;
+}
+
+void SamReader::load_index(){
+    hts_idx_t* idx = sam_index_load(this->in, filename.c_str()); //&hts_idx_destroy
+    if (idx == nullptr){
+    	//error
+    	throw std::runtime_error("error loading index for " + filename);
+    }
+    this->idx = idx;
+}
+
+//a new iterator over the same handle and index, so a worker can walk many shards without reopening the file
+void SamReader::set_region(interval_t r){
+	if (idx == nullptr){
+		load_index();
+	}
+	std::string name = get_ref_name(std::get<0>(r)) + ":" + std::to_string(std::get<1>(r) + 1) + "-" + std::to_string(std::get<2>(r));
+	hts_itr_t* it = sam_itr_queryi(idx, std::get<0>(r), std::get<1>(r), std::get<2>(r)); //&hts_itr_destroy
+	if (it == nullptr){
+		throw std::runtime_error("error querying region " + name);
+	}
+	if (iter != nullptr){
+		hts_itr_destroy(iter);
+	}
+	this->iter = it;
+	this->intervals = std::vector<interval_t>(1, r);
+	this->region = name;
+	this->region_exists = true;
+}
+
+//chr, chr:beg or chr:beg-end, 1-based inclusive like samtools
+interval_t SamReader::parse_region(std::string r){
+	size_t colon = r.rfind(':');
+	if (colon != std::string::npos && header_name_exists(r.substr(0,colon))){
+		std::string name = r.substr(0,colon);
+		std::string range = r.substr(colon+1);
+		int tid = get_ref_tid(name);
+		size_t dash = range.find('-');
+		int beg = std::stoi(range.substr(0,dash)) - 1;
+		int end = (dash == std::string::npos || dash + 1 == range.size() ? get_ref_len(tid) : std::stoi(range.substr(dash+1)));
+		if (beg < 0 || end < beg){
+			throw std::runtime_error("error parsing region " + r);
+		}
+		return std::make_tuple(tid, beg, std::min(end, get_ref_len(tid)));
+	}
+	int tid = get_ref_tid(r);
+	return std::make_tuple(tid, 0, get_ref_len(tid));
+}
+
+//spec is either a BED file or a comma separated list of regions
+std::vector<interval_t> SamReader::parse_regions(std::string spec){
+	std::vector<interval_t> v;
+	std::ifstream bed(spec);
+	if (bed.is_open()){
+		for(std::string line; std::getline(bed,line);){
+			if (line.empty() || line[0] == '#' || line.compare(0,5,"track") == 0 || line.compare(0,7,"browser") == 0){
+				continue;
+			}
+			std::istringstream fields(line);
+			std::string chr;
+			int beg, end;
+			if (!(fields >> chr >> beg >> end)){
+				throw std::runtime_error("error parsing BED line: " + line);
+			}
+			int tid = get_ref_tid(chr);
+			v.push_back(std::make_tuple(tid, beg, std::min(end, get_ref_len(tid))));
+		}
+	}
+	else{
+		std::istringstream list(spec);
+		for(std::string r; std::getline(list,r,',');){
+			if (!r.empty()){
+				v.push_back(parse_region(r));
+			}
+		}
+	}
+	if (v.empty()){
+		throw std::runtime_error("no regions in " + spec);
+	}
+	return v;
+}
+
+std::vector<interval_t> SamReader::merge_intervals(std::vector<interval_t> v){
+	std::sort(v.begin(), v.end());
+	std::vector<interval_t> merged;
+	for (const interval_t &i : v){
+		if (std::get<2>(i) <= std::get<1>(i)){
+			continue;
+		}
+		if (!merged.empty() && std::get<0>(merged.back()) == std::get<0>(i) && std::get<1>(i) <= std::get<2>(merged.back())){
+			std::get<2>(merged.back()) = std::max(std::get<2>(merged.back()), std::get<2>(i));
+		}
+		else{
+			merged.push_back(i);
+		}
+	}
+	return merged;
+}
+
+bool SamReader::in_region(int tid, int pos){
+	if (!has_region()){
+		return true;
+	}
+	//first interval starting after pos; the one before it is the only candidate
+	auto it = std::upper_bound(intervals.begin(), intervals.end(), std::make_tuple(tid, pos, std::numeric_limits<int>::max()));
+	if (it == intervals.begin()){
+		return false;
+	}
+	--it;
+	return std::get<0>(*it) == tid && std::get<1>(*it) <= pos && pos < std::get<2>(*it);
+}
+
+const std::vector<interval_t> &SamReader::get_intervals(){
+	return intervals;
+}
+
+//true if filename can be opened and has an index
+bool SamReader::has_index(std::string filename){
+	htsFile* htsin = hts_open(filename.c_str(), "r");
+	if (htsin == NULL){
+		return false;
+	}
+	hts_idx_t* idx = sam_index_load(htsin, filename.c_str());
+	bool found = (idx != nullptr);
+	if (found){
+		hts_idx_destroy(idx);
+	}
+	sam_close(htsin);
+	return found;
 }
 
 //updates b with next read; returns >=0 on success
@@ -82,6 +285,17 @@ int SamReader::next(bam1_t* b){
 	}
 }
 
+//readgroups missing from the header are interned the first time they're seen
+rgid_t SamReader::get_readgroup_id(const bam1_t *b){
+	uint8_t *aux = bam_aux_get(b, "RG");
+	const char *rg = (aux == nullptr ? nullptr : bam_aux2Z(aux));
+	return intern_readgroup(rg == nullptr ? "" : rg);
+}
+
+const std::vector<std::string> &SamReader::get_readgroups(){
+	return readgroups;
+}
+
 bool SamReader::has_region(){
 	return this->region_exists;
 }
@@ -98,6 +312,23 @@ std::string SamReader::get_ref_name(int tid){
 	return std::string(header->target_name[tid]);
 }
 
+int SamReader::get_ref_len(int tid){
+	return header->target_len[tid];
+}
+
+int SamReader::num_refs(){
+	return header->n_targets;
+}
+
+bool SamReader::header_name_exists(std::string name){
+	for (int i = 0; i < header->n_targets; ++i){
+		if (get_ref_name(i) == name){
+			return true;
+		}
+	}
+	return false;
+}
+
 //return tid of given name
 int SamReader::get_ref_tid(std::string name){
 	for (int i = 0; i < header->n_targets; ++i){
@@ -127,24 +358,28 @@ SamWriter::SamWriter(){
 	this->outfh = hts_open("-", "w");
 	this->header = nullptr;
 	check_open_success();
+	HtsPool::attach(this->outfh);
 }
 
 SamWriter::SamWriter(std::string filename){
 	this->outfh = hts_open(filename.c_str(), "w");
 	this->header = nullptr;
 	check_open_success();
+	HtsPool::attach(this->outfh);
 }
 
 SamWriter::SamWriter(bam_hdr_t* h){
 	this->outfh = hts_open("-", "w");
 	this->header = h;
 	check_open_success();
+	HtsPool::attach(this->outfh);
 }
 
 SamWriter::SamWriter(std::string filename, bam_hdr_t* h){
 	this->outfh = hts_open(filename.c_str(), "w");
 	this->header = h;
 	check_open_success();
+	HtsPool::attach(this->outfh);
 }
 
 SamWriter::~SamWriter(){
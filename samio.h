@@ -6,7 +6,13 @@
 #include <htslib/sam.h>
 #include <string>
 #include <map>
+#include <vector>
+#include <tuple>
 #include <cstddef>
+#include <cstdint>
+
+typedef std::tuple<int,int,int> interval_t; //(tid, beg, end); 0-based, half open
+typedef uint16_t rgid_t; //interned readgroup
 
 class SamReader{
 protected:
@@ -14,23 +20,47 @@ protected:
 	bam_hdr_t* header;
 	hts_idx_t* idx;
 	hts_itr_t* iter;
+	std::string filename;
 	std::string region;
 	bool region_exists;
+	std::vector<interval_t> intervals; //sorted and merged
+	std::vector<std::string> readgroups; //readgroups[id] = RG, header @RG lines first
+	std::map<std::string,rgid_t> readgroup_ids;
 	void open(std::string);
+	void load_readgroups();
+	rgid_t intern_readgroup(const std::string &rg);
 	void open(std::string, std::string);
+	void load_index(); //throws if there isn't one
+	interval_t parse_region(std::string r);
+	bool header_name_exists(std::string name);
+	std::vector<interval_t> parse_regions(std::string spec);
 public:
 	bool has_region();
+	bool in_region(int tid, int pos); //true if there is no region or pos is in one of the regions
+	const std::vector<interval_t> &get_intervals();
+	void set_region(interval_t r); //re-query the open file; reading starts over at r. needs an index. throws.
+	static std::vector<interval_t> merge_intervals(std::vector<interval_t> v);
 	bam_hdr_t* get_header();
 	int next(bam1_t *b);
+	rgid_t get_readgroup_id(const bam1_t *b); //reads without an RG tag get the id of ""
+	const std::vector<std::string> &get_readgroups(); //indexed by rgid_t
 	std::string get_ref_name(bam1_t* b);
 	std::string get_ref_name(int tid);
+	int get_ref_len(int tid);
+	int num_refs();
 	int get_ref_tid(std::string name);
 	std::map<std::string,int> get_name_map();
 	SamReader();
 	SamReader(const std::string filename);
-	SamReader(const std::string filename, const std::string region);
+	SamReader(const std::string filename, const std::string region); //region is a BED file or a comma separated list of regions
 	SamReader(nullptr_t);
 	~SamReader();
+	static bool has_index(std::string filename);
+	bool is_cram();
+	void set_reference(std::string reffile); //fasta to decode CRAM against; call before reading. does nothing for SAM/BAM. throws.
+	void set_required_fields(int fields); //OR of SAM_* fields CRAM needs to decode; the rest are skipped. does nothing for SAM/BAM. throws.
+	static const int pileup_fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ | SAM_QUAL | SAM_RGAUX; //what Pileup reads
+	static const int mate_fields = SAM_QNAME | SAM_RNEXT | SAM_PNEXT | SAM_TLEN; //what finding overlapping mates needs
 };
 
 class SamWriter{
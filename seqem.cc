@@ -7,12 +7,18 @@
 #include <cerrno>
 #include <cstring>
 #include <limits>
+#include <numeric>
+#include "parallel.h"
+#include "gl_table.h"
+#include "errmodel.h"
 
 const std::map<char,double> Seqem::uniform_pi = {{'A',.25},{'T',.25},{'C',.25},{'G',.25}};
 
 Seqem::Seqem(Pileupdata p, int ploidy) : plp(p), theta(std::make_tuple(0.01)),
-	em(std::bind(&Seqem::q_function, this, std::placeholders::_1), std::bind(&Seqem::m_function,this,std::placeholders::_1), theta),
-	ploidy(ploidy){
+	em(std::bind(&Seqem::e_step, this, std::placeholders::_1), std::bind(&Seqem::q_function, this, std::placeholders::_1), std::bind(&Seqem::m_function,this,std::placeholders::_1), theta),
+	ploidy(ploidy), threads(meep_parallel::default_threads()), estep(ploidy),
+	rg_em(std::bind(&Seqem::rg_e_step, this, std::placeholders::_1), std::bind(&Seqem::rg_q_function, this, std::placeholders::_1), std::bind(&Seqem::rg_m_function, this, std::placeholders::_1), rg_theta_t()),
+	rg_estep(), readgroup_run(false){
 	possible_gts = Genotype::enumerate_gts(ploidy);
 }
 
@@ -20,8 +26,10 @@ Seqem::Seqem(Pileupdata p): Seqem(p, 2){
 }
 
 Seqem::Seqem(std::string samfile, std::string refname, int ploidy) : plp(samfile, refname), theta(std::make_tuple(0.1)),
-	em(std::bind(&Seqem::q_function, this, std::placeholders::_1), std::bind(&Seqem::m_function,this,std::placeholders::_1), theta),
-	ploidy(ploidy){
+	em(std::bind(&Seqem::e_step, this, std::placeholders::_1), std::bind(&Seqem::q_function, this, std::placeholders::_1), std::bind(&Seqem::m_function,this,std::placeholders::_1), theta),
+	ploidy(ploidy), threads(meep_parallel::default_threads()), estep(ploidy),
+	rg_em(std::bind(&Seqem::rg_e_step, this, std::placeholders::_1), std::bind(&Seqem::rg_q_function, this, std::placeholders::_1), std::bind(&Seqem::rg_m_function, this, std::placeholders::_1), rg_theta_t()),
+	rg_estep(), readgroup_run(false){
 	possible_gts = Genotype::enumerate_gts(ploidy);
 }
 
@@ -29,59 +37,208 @@ Seqem::Seqem(std::string samfile, std::string refname) : Seqem(samfile, refname,
 }
 
 Seqem::theta_t Seqem::start(double stop){
+	readgroup_run = false;
 	return em.start(stop);
 }
 
-double Seqem::q_function(theta_t theta){
-	double likelihood = 0.0;
-	pileupdata_t plpdata = plp.get_data();
-
-	for (pileupdata_t::iterator tid = plpdata.begin(); tid != plpdata.end(); ++tid){
-		for(std::vector<pileuptuple_t>::iterator pos = tid->begin(); pos != tid->end(); ++pos){
-			const std::vector<char> &x = std::get<0>(*pos);
-			for (std::vector<Genotype>::iterator g = possible_gts.begin(); g != possible_gts.end(); ++g){
-				likelihood += pg_x_given_theta(*g,x,theta,uniform_pi);
+//every readgroup starts from the single epsilon guess
+std::vector<double> Seqem::start_readgroups(double stop){
+	if (plp.get_rg_pattern_list().empty() && !plp.get_pattern_list().empty()){
+		throw std::runtime_error("per-readgroup epsilons need per-site data, which this pileup didn't keep");
+	}
+	readgroup_run = true;
+	rg_em.set_theta(std::make_tuple(std::vector<double>(plp.get_readgroups().size(), std::get<0>(theta))));
+	return std::get<0>(rg_em.start(stop));
+}
+
+void Seqem::set_max_iterations(int n){
+	em.set_max_iterations(n);
+	rg_em.set_max_iterations(n);
+}
+
+void Seqem::set_acceleration(bool on){
+	em.set_acceleration(on);
+	rg_em.set_acceleration(on);
+}
+
+int Seqem::get_iterations(){
+	return readgroup_run ? rg_em.get_iterations() : em.get_iterations();
+}
+
+void Seqem::set_threads(int n){
+	threads = n;
+}
+
+void Seqem::set_tracing(bool on){
+	em.set_tracing(on);
+	rg_em.set_tracing(on);
+}
+
+void Seqem::set_observer(em_observer_f f){
+	em.set_observer(f);
+	rg_em.set_observer(f);
+}
+
+const EM_Trace &Seqem::get_trace(){
+	return readgroup_run ? rg_em.get_trace() : em.get_trace();
+}
+
+//the log likelihood and s come from the same genotype posteriors. EM evaluates q at every new theta before stepping
+//from it, so m_function always finds its statistics here.
+//each chunk of patterns gets its own partial sums, added up in chunk order at the end.
+void Seqem::e_step(theta_t theta){
+	if (estep.valid && estep.theta == theta){
+		return;
+	}
+	const patternlist_t &patterns = plp.get_pattern_list();
+	size_t chunks = meep_parallel::num_chunks(patterns.size());
+	std::vector<double> partial_likelihood(chunks, 0.0);
+	std::vector<std::vector<double>> partial_s(chunks, std::vector<double>(ploidy + 1,0.0));
+	GL_Table table(possible_gts, std::get<0>(theta), uniform_pi);
+	meep_parallel::parallel_chunks(patterns.size(), threads, [&](size_t chunk, size_t begin, size_t end){
+		std::vector<double> posteriors(possible_gts.size());
+		for (size_t i = begin; i < end; ++i){
+			const allelecounts_t &x = std::get<1>(patterns[i].first);
+			int weight = patterns[i].second;
+			partial_likelihood[chunk] += weight * table.posteriors(x, posteriors.data());
+			for (size_t j = 0; j < possible_gts.size(); ++j){
+				table.add_s(partial_s[chunk], x, j, weight * posteriors[j]);
 			}
 		}
+	});
+	estep.theta = theta;
+	estep.likelihood = std::accumulate(partial_likelihood.begin(), partial_likelihood.end(), 0.0);
+	estep.s.assign(ploidy + 1,0.0);
+	for (const std::vector<double> &p : partial_s){
+		for (size_t k = 0; k < estep.s.size(); ++k){
+			estep.s[k] += p[k];
+		}
 	}
-	return likelihood;
+	estep.valid = true;
+}
+
+double Seqem::q_function(theta_t theta){
+	e_step(theta);
+	return estep.likelihood;
 }
 
 Seqem::theta_t Seqem::m_function(theta_t theta){
-	pileupdata_t plpdata = plp.get_data();
-	std::vector<double> s(3,0.0); //TODO:make this generic, depends on ploidy
+	e_step(theta);
+	return std::make_tuple(calc_epsilon(estep.s));
+}
 
-	for (pileupdata_t::iterator tid = plpdata.begin(); tid != plpdata.end(); ++tid){
-		for(std::vector<pileuptuple_t>::iterator pos = tid->begin(); pos != tid->end(); ++pos){
-			increment_s(s, std::get<0>(*pos), possible_gts, theta, uniform_pi);
+//a base from readgroup rg is drawn with that readgroup's epsilon, so log P(x | g) is a sum of one
+//GL_Table dot product per readgroup present at the site. the posteriors are shared, but each
+//readgroup's bases go into its own row of s, and the M step solves each row for its own epsilon.
+void Seqem::rg_e_step(rg_theta_t theta){
+	if (rg_estep.valid && rg_estep.theta == theta){
+		return;
+	}
+	const std::vector<double> &epsilons = std::get<0>(theta);
+	const rgpatternlist_t &patterns = plp.get_rg_pattern_list();
+	size_t readgroups = epsilons.size();
+	size_t width = ploidy + 1;
+	size_t ngts = possible_gts.size();
+	std::vector<GL_Table> tables;
+	for (double e : epsilons){
+		tables.emplace_back(possible_gts, e);
+	}
+	std::vector<double> logprior;
+	for (const Genotype &g : possible_gts){
+		logprior.push_back(pg(g, uniform_pi));
+	}
+	size_t chunks = meep_parallel::num_chunks(patterns.size());
+	std::vector<double> partial_likelihood(chunks, 0.0);
+	std::vector<std::vector<double>> partial_s(chunks, std::vector<double>(readgroups * width, 0.0));
+	meep_parallel::parallel_chunks(patterns.size(), threads, [&](size_t chunk, size_t begin, size_t end){
+		std::vector<double> posteriors(ngts);
+		std::vector<double> logp(ngts);
+		std::vector<size_t> present; //readgroups with bases at this pattern
+		for (size_t i = begin; i < end; ++i){
+			const rgcounts_t &x = std::get<1>(patterns[i].first);
+			int weight = patterns[i].second;
+			posteriors.assign(logprior.begin(), logprior.end());
+			present.clear();
+			for (size_t rg = 0; rg < readgroups; ++rg){
+				if (x[rg] == allelecounts_t()){
+					continue;
+				}
+				present.push_back(rg);
+				tables[rg].loglikelihoods(x[rg], logp.data());
+				for (size_t g = 0; g < ngts; ++g){
+					posteriors[g] += logp[g];
+				}
+			}
+			partial_likelihood[chunk] += weight * GL_Table::normalize(posteriors.data(), ngts);
+			for (size_t rg : present){
+				double *s = partial_s[chunk].data() + rg * width;
+				for (size_t g = 0; g < ngts; ++g){
+					tables[rg].add_s(s, x[rg], g, weight * posteriors[g]);
+				}
+			}
+		}
+	});
+	rg_estep.theta = theta;
+	rg_estep.likelihood = std::accumulate(partial_likelihood.begin(), partial_likelihood.end(), 0.0);
+	rg_estep.s.assign(readgroups * width, 0.0);
+	for (const std::vector<double> &p : partial_s){
+		for (size_t k = 0; k < rg_estep.s.size(); ++k){
+			rg_estep.s[k] += p[k];
 		}
 	}
-	return std::make_tuple(calc_epsilon(s));
+	rg_estep.valid = true;
 }
 
-void Seqem::increment_s(std::vector<double> &s, std::vector<char> x, const std::vector<Genotype> gts, theta_t theta, std::map<char,double> pi){
-	for (auto g : gts){
-		std::vector<double> site_s = calc_s(x,g);
-		double pg_x = pg_x_given_theta(g,x,theta,pi);
-		for(size_t i = 0; i < s.size(); ++i){
-			s[i] += pg_x * site_s[i];	
+double Seqem::rg_q_function(rg_theta_t theta){
+	rg_e_step(theta);
+	return rg_estep.likelihood;
+}
+
+//readgroups without any bases keep their epsilon
+Seqem::rg_theta_t Seqem::rg_m_function(rg_theta_t theta){
+	rg_e_step(theta);
+	std::vector<double> epsilons = std::get<0>(theta);
+	size_t width = ploidy + 1;
+	for (size_t rg = 0; rg < epsilons.size(); ++rg){
+		std::vector<double> s(rg_estep.s.begin() + rg * width, rg_estep.s.begin() + (rg + 1) * width);
+		if (std::accumulate(s.begin(), s.end(), 0.0) > 0.0){
+			epsilons[rg] = calc_epsilon(s);
 		}
 	}
+	return std::make_tuple(epsilons);
 }
 
-std::vector<double> Seqem::calc_s(std::vector<char> x, Genotype g){ //TODO: make this generic
-	std::vector<double> s(3,0.0);
+//non-ACGT bases aren't counted, as in the site patterns
+void Seqem::increment_s(std::vector<double> &s, std::vector<char> x, const std::vector<Genotype> gts, theta_t theta, std::map<char,double> pi){
+	increment_s(s, Pileupdata::count_alleles(x), gts, theta, pi, 1);
+}
+
+//each genotype's s is weighted by P(g | x), as in e_step, not by P(g, x)
+void Seqem::increment_s(std::vector<double> &s, const allelecounts_t &x, const std::vector<Genotype> gts, theta_t theta, std::map<char,double> pi, int weight){
+	GL_Table table(gts, std::get<0>(theta), pi);
+	std::vector<double> posteriors(gts.size());
+	table.posteriors(x, posteriors.data());
+	for (size_t g = 0; g < gts.size(); ++g){
+		table.add_s(s, x, g, weight * posteriors[g]);
+	}
+}
+
+//s[i] counts bases matching ploidy - i of g's alleles
+std::vector<double> Seqem::calc_s(const allelecounts_t &x, Genotype g){
+	int ploidy = g.getploidy();
+	std::vector<double> s(ploidy + 1,0.0);
+	for (size_t i = 0; i < x.size(); ++i){
+		s[ploidy - g.count(i)] += x[i];
+	}
+	return s;
+}
+
+//bases that aren't one of Genotype::alleles match nothing
+std::vector<double> Seqem::calc_s(std::vector<char> x, Genotype g){
+	int ploidy = g.getploidy();
+	std::vector<double> s(ploidy + 1,0.0);
 	for (std::vector<char>::iterator i = x.begin(); i != x.end(); ++i){
-		int numgt = g.numbase(*i);
-		if (numgt == 2){
-			s[0]++;
-		}
-		else if (numgt == 1){
-			s[1]++;
-		}
-		else if (numgt == 0){
-			s[2]++;
-		}
+		s[ploidy - g.numbase(*i)]++;
 	}
 	return s;
 }
@@ -92,49 +249,32 @@ double Seqem::pg_x_given_theta(const Genotype g,const std::vector<char> x,const
 	return exp(px + pg(g,pi));
 }
 
-//may be faster if we represent x as a map w/ char and counts, like gt?? we support this in plpdata
-double Seqem::px_given_gtheta(const std::vector<char> x,const Genotype g,const theta_t theta){
-	double px = 0.0;
-	std::map<char, int> counts;
+//RESULT NOT IN LOG SPACE
+double Seqem::pg_x_given_theta(const Genotype g, const allelecounts_t &x, const theta_t theta, std::map<char,double> pi){
+	double px = px_given_gtheta(x,g,theta);
+	return exp(px + pg(g,pi));
+}
 
-	for (std::vector<char>::const_iterator i = x.begin(); i != x.end(); ++i){
-		counts[*i] += 1;
-	}
-	for (std::map<char,int>::iterator i = counts.begin(); i!= counts.end(); ++i){
-		double pn = pn_given_gtheta(i->first,g,theta);
-		if (pn == -std::numeric_limits<double>::infinity()){
-			return -std::numeric_limits<double>::infinity();
-		}
-		else{
-			px += i->second * pn;
-			// px -= std::lgamma(i->second + 1);
-		}
-	}
-	// px += std::lgamma(x.size()+1);
-	return px;
+//x holds the count of each of Genotype::alleles, so this only depends on the site pattern.
+//for many sites at one theta build a GL_Table once instead.
+double Seqem::px_given_gtheta(const allelecounts_t &x, const Genotype g, const theta_t theta){
+	return GL_Table(std::vector<Genotype>(1,g), std::get<0>(theta)).loglikelihood(x, 0);
+}
+
+//non-ACGT bases aren't counted, as in the site patterns
+double Seqem::px_given_gtheta(const std::vector<char> x,const Genotype g,const theta_t theta){
+	return px_given_gtheta(Pileupdata::count_alleles(x), g, theta);
 }
 
 //LOG SPACE
 double Seqem::pn_given_gtheta(char n, Genotype g, theta_t theta){
 	double epsilon = std::get<0>(theta);
-	double p;
-	// p = ((double)g.numbase(n))/g.getploidy()*(1.0-3.0*epsilon) + ((double)g.numnotbase(n))/g.getploidy()*epsilon;
-	int numgt = g.numbase(n);
-	if (numgt == 2){
-		p = (1.0 - 3.0 * epsilon);
-	}
-	else if (numgt == 1){
-		p = (0.5 - epsilon);
-	}
-	else{
-		p = epsilon;
-	}
+	double p = meep_errmodel::p_base(g.numbase(n), g.getploidy(), epsilon);
 	if (p == 0){
 		return -std::numeric_limits<double>::infinity();
 	}
 	else if (p < 0){
-		std::clog << "N=" << n << "\tGT=" << g << "\tPloidy=" << g.getploidy() << "\t#N=" << g.numbase(n) << "\t#!N=" << g.numnotbase(n) << "\tP1=" << ((double)g.numbase(n))/g.getploidy()*(1-3*epsilon) << "\tP2=" << ((double)g.numnotbase(n))/g.getploidy()*epsilon << "\tP=" << p << "\tTheta=" << theta << std::endl;
-		throw std::runtime_error("p < 0 detected");
+		throw std::runtime_error("p < 0 detected for base " + std::string(1,n) + " with epsilon " + std::to_string(epsilon));
 	}
 	else{
 		return log(p);
@@ -143,26 +283,17 @@ double Seqem::pn_given_gtheta(char n, Genotype g, theta_t theta){
 
 double Seqem::pg(Genotype g, std::map<char,double> pi){
 	double p = 0.0;
-	for (auto it=g.gt.begin(); it != g.gt.end(); ++it){
-		p += it->second * log(pi[it->first]);
+	for (size_t a = 0; a < Genotype::numalleles; ++a){
+		if (g.count(a) != 0){
+			p += g.count(a) * log(pi[Genotype::alleles[a]]);
+		}
 	}
 	return p;
 }
 
+//s has ploidy + 1 entries; see errmodel.h
 double Seqem::calc_epsilon(std::vector<double> s){
-	double a = 3.0 * (s[0] + s[1] + s[2]);
-	double b = - (3.0/2 * s[0] + s[1] + 5.0/2 * s[2]);
-	double c = s[2] / 2;
-	double epsilon_minus = (-b - sqrt(std::pow(b,2) - 4 * a * c))/(2 * a);
-	// double epsilon_plus = (-b + sqrt(std::pow(b,2) - 4 * a * c))/(2 * a);
-	double epsilon;
-	if (epsilon_minus < 0){
-		epsilon = 0;
-	}
-	else{
-		epsilon = epsilon_minus;
-	}
-	return epsilon;
+	return meep_errmodel::calc_epsilon(s);
 }
 
 double Seqem::smallest_nonzero(std::vector<double> v){
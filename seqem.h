@@ -11,27 +11,66 @@
 
 class Seqem{
 	typedef std::tuple<double> theta_t; //epsilon parameter
+	//everything q_function and m_function need at one theta, from one pass over the patterns
+	struct Estep{
+		theta_t theta;
+		bool valid;
+		double likelihood;
+		std::vector<double> s;
+		Estep(int ploidy) : theta(), valid(false), likelihood(0.0), s(ploidy + 1,0.0) {};
+	};
+public:
+	typedef std::tuple<std::vector<double>> rg_theta_t; //epsilon per readgroup, indexed by rgid_t
+	//Estep for per-readgroup epsilons. s is readgroups x (ploidy + 1), row major.
+	struct Rg_estep{
+		rg_theta_t theta;
+		bool valid;
+		double likelihood;
+		std::vector<double> s;
+		Rg_estep() : theta(), valid(false), likelihood(0.0), s() {};
+	};
 protected:
 	Pileupdata plp;
 	theta_t theta;
 	EM<double> em;
 	int ploidy;
 	std::vector<Genotype> possible_gts;
+	int threads; //for the E step
+	Estep estep;
+	EM<std::vector<double>> rg_em;
+	Rg_estep rg_estep;
+	bool readgroup_run; //whether the last run was start_readgroups
 public:
 	Seqem(Pileupdata p, int ploidy);
 	Seqem(Pileupdata p);
 	Seqem(std::string samfile, std::string refname);
 	Seqem(std::string samfile, std::string refname, int ploidy);
 	theta_t start(double stop);
-	double q_function(theta_t theta);
+	std::vector<double> start_readgroups(double stop); //one epsilon per readgroup in plp.get_readgroups(), all fitted in the same pass over sites. throws if sites weren't kept
+	void set_max_iterations(int n);
+	void set_acceleration(bool on); //SQUAREM; off by default
+	int get_iterations(); //M steps taken by the last start() or start_readgroups()
+	void set_threads(int n); //defaults to every hardware thread
+	void set_tracing(bool on); //record an EM_Record per iteration; off by default
+	void set_observer(em_observer_f f);
+	const EM_Trace &get_trace(); //of the last start() or start_readgroups()
+	void e_step(theta_t theta); //fill estep unless it already holds theta
+	double q_function(theta_t theta); //log likelihood of the patterns
 	theta_t m_function(theta_t theta);
-	static void increment_s(std::vector<double> &s, std::vector<char> x, std::vector<Genotype> possible_gts, theta_t theta, std::map<char,double> pi); //mutates s
+	void rg_e_step(rg_theta_t theta); //fill rg_estep unless it already holds theta
+	double rg_q_function(rg_theta_t theta);
+	rg_theta_t rg_m_function(rg_theta_t theta);
+	static void increment_s(std::vector<double> &s, std::vector<char> x, std::vector<Genotype> possible_gts, theta_t theta, std::map<char,double> pi); //mutates s; s += E[calc_s(x, g) | x]
+	static void increment_s(std::vector<double> &s, const allelecounts_t &x, std::vector<Genotype> possible_gts, theta_t theta, std::map<char,double> pi, int weight); //mutates s; s += weight * E[calc_s(x, g) | x]. weight = # sites with pattern x
 	static std::vector<double> calc_s(std::vector<char> x, Genotype g);
+	static std::vector<double> calc_s(const allelecounts_t &x, Genotype g);
 	static double pg_x_given_theta(Genotype g, std::vector<char> x, theta_t theta, std::map<char,double> pi); //not log space
+	static double pg_x_given_theta(Genotype g, const allelecounts_t &x, theta_t theta, std::map<char,double> pi); //not log space
 	static double px_given_gtheta(std::vector<char> x, Genotype g, theta_t theta); // log space
+	static double px_given_gtheta(const allelecounts_t &x, Genotype g, theta_t theta); // log space
 	static double pn_given_gtheta(char n, Genotype g, theta_t theta); //log space
 	static double pg(Genotype g, std::map<char,double> pi); //log space
-	static double calc_epsilon(std::vector<double> s);
+	static double calc_epsilon(std::vector<double> s); //s[i] counts bases matching ploidy - i alleles
 	static double smallest_nonzero(const std::vector<double> v);
 	static const std::map<char,double> uniform_pi;
 };
@@ -8,32 +8,7 @@
 #include <vector>
 #include <map>
 
-//check out http://en.cppreference.com/w/cpp/utility/tuple/tuple_cat for another example
-// also http://stackoverflow.com/questions/6245735/pretty-print-stdtuple
-template<size_t N>
-struct TuplePrinter{
-	template<typename...T>
-	static typename std::enable_if<(N<sizeof...(T))>::type
-	print(std::ostream& os, const std::tuple<T...> t){
-		os << ", " << std::get<N>(t);
-		TuplePrinter<N+1>::print(os,t);
-	}
-
-	template<typename...T>
-	static typename std::enable_if<!(N<sizeof...(T))>::type
-	print(std::ostream& os, const std::tuple<T...> t){
-	}
-};
-
-template<typename T0, typename...T>
-std::ostream& operator<<(std::ostream& os, const std::tuple<T0, T...> t){
-	os << '(' << std::get<0>(t); // << quote << std::get<0>(t) << quote;
-	TuplePrinter<1>::print(os,t);
-	return os << ')';
-}
-
-std::ostream& operator<<(std::ostream& os, const std::tuple<>);
-
+//containers come first so the tuple printer can find them for tuple members
 //Vector printing
 template<typename T>
 std::ostream& operator<<(std::ostream& os, const std::vector<T> vec){
@@ -42,7 +17,7 @@ std::ostream& operator<<(std::ostream& os, const std::vector<T> vec){
 	}
 	else{
 		os << "[ " << vec[0];
-		for (int i = 1; i < vec.size(); ++i){
+		for (size_t i = 1; i < vec.size(); ++i){
 			os << ", " << vec[i];
 		}
 		return os << " ]";
@@ -65,5 +40,31 @@ std::ostream& operator<<(std::ostream& os, const std::map<T,U> m){
 	}
 }
 
+//check out http://en.cppreference.com/w/cpp/utility/tuple/tuple_cat for another example
+// also http://stackoverflow.com/questions/6245735/pretty-print-stdtuple
+template<size_t N>
+struct TuplePrinter{
+	template<typename...T>
+	static typename std::enable_if<(N<sizeof...(T))>::type
+	print(std::ostream& os, const std::tuple<T...> t){
+		os << ", " << std::get<N>(t);
+		TuplePrinter<N+1>::print(os,t);
+	}
+
+	template<typename...T>
+	static typename std::enable_if<!(N<sizeof...(T))>::type
+	print(std::ostream& os, const std::tuple<T...> t){
+	}
+};
+
+template<typename T0, typename...T>
+std::ostream& operator<<(std::ostream& os, const std::tuple<T0, T...> t){
+	os << '(' << std::get<0>(t); // << quote << std::get<0>(t) << quote;
+	TuplePrinter<1>::print(os,t);
+	return os << ')';
+}
+
+std::ostream& operator<<(std::ostream& os, const std::tuple<>);
+
 
 #endif
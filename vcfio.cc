@@ -1,4 +1,5 @@
 #include "vcfio.h"
+#include "htspool.h"
 #include <stdexcept>
 
 // VCFWriter::VCFWriter() : outfh(), header() {
@@ -24,6 +25,7 @@
 VCFWriter::VCFWriter(std::string filename, bcf_hdr_t* h) : outfh(), header(h) {
 	this->outfh = hts_open(filename.c_str(), "w");
 	check_open_success();
+	HtsPool::attach(outfh);
 }
 
 VCFWriter::VCFWriter(std::string filename) : VCFWriter(filename, nullptr) {
@@ -43,19 +45,19 @@ VCFWriter::~VCFWriter(){
 	}
 }
 
-VCFWriter::check_open_success(){
+void VCFWriter::check_open_success(){
 	if (outfh == nullptr){
 		throw std::runtime_error("error opening vcf for writing");
 	}
 }
 
-VCFWriter::append_to_header(std::string s){
+void VCFWriter::append_to_header(std::string s){
 	if (bcf_hdr_append(header, s.c_str()) != 0){
 		throw std::runtime_error("error appending to header");
 	}
 }
 
-VCFWriter::write_header(){
+void VCFWriter::write_header(){
 	if (this->header == nullptr){
 		throw std::runtime_error("error writing header: null header");
 	}
@@ -66,7 +68,7 @@ VCFWriter::write_header(){
 	}
 }
 
-VCFWriter::write_variant(bcf1_t *v){
+void VCFWriter::write_variant(bcf1_t *v){
 	if (bcf_write(this->outfh, this->header, v) < 0){
 		throw std::runtime_error("error writing read");
 	}
@@ -4,7 +4,7 @@
 #include <htslib/vcf.h>
 #include <string>
 
-class VCFwriter{
+class VCFWriter{
 protected:
 	htsFile* outfh;
 	bcf_hdr_t* header;
@@ -18,7 +18,7 @@ public:
 	void append_to_header(std::string s); // void, call before writing header. throws on error.
 	void append_to_headef(); //void, throws on error
 	void write_header(); //throws error if header is null or fails to write
-	void write_variant(bcf1_t);
+	void write_variant(bcf1_t*);
 };
 
 